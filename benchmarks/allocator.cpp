@@ -0,0 +1,83 @@
+#include "bench.hpp"
+#include "coroutine/frame_allocator.hpp"
+#include "queue/pool_allocator.hpp"
+
+#include <array>
+
+/* pool_allocator shared by every thread, each one allocates a batch of
+ * objects the size of a uring_data and frees it again. Ops are allocations
+ * plus deallocations. frame_allocator runs the same churn with frames of the
+ * same size.
+ */
+
+constexpr unsigned int batch = 32;
+
+struct object {
+  char m_data[64];
+};
+
+using allocator = pool_allocator<object, 128>;
+
+template <typename Allocate, typename Deallocate>
+uint64_t churn(Allocate allocate, Deallocate deallocate, std::atomic_bool &stop,
+               latency_samples &latencies) {
+  std::array<object *, batch> objects;
+  uint64_t ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (auto &obj : objects) {
+      if (latencies.sample()) {
+        auto begin = std::chrono::steady_clock::now();
+        obj        = allocate();
+        latencies.add(std::chrono::steady_clock::now() - begin);
+      } else {
+        obj = allocate();
+      }
+    }
+    for (auto &obj : objects) {
+      if (latencies.sample()) {
+        auto begin = std::chrono::steady_clock::now();
+        deallocate(obj);
+        latencies.add(std::chrono::steady_clock::now() - begin);
+      } else {
+        deallocate(obj);
+      }
+    }
+    ops += 2 * batch;
+  }
+  return ops;
+}
+
+int main(int argc, char **argv) {
+  bench_options options = parse_options(argc, argv);
+  bench_report report(options);
+
+  for (auto threads : thread_counts(options.max_threads)) {
+    allocator pool;
+    report.add(run_threads("pool_allocator", threads, options.duration,
+                           [&](unsigned int, std::atomic_bool &stop,
+                               latency_samples &latencies) {
+                             return churn([&] { return pool.allocate(); },
+                                          [&](object *obj) {
+                                            pool.deallocate(obj);
+                                          },
+                                          stop, latencies);
+                           }));
+  }
+
+  for (auto threads : thread_counts(options.max_threads)) {
+    report.add(run_threads(
+        "frame_allocator", threads, options.duration,
+        [&](unsigned int, std::atomic_bool &stop, latency_samples &latencies) {
+          return churn(
+              [] {
+                return static_cast<object *>(
+                    frame_allocator::allocate(sizeof(object)));
+              },
+              [](object *obj) {
+                frame_allocator::deallocate(obj, sizeof(object));
+              },
+              stop, latencies);
+        }));
+  }
+  return 0;
+}
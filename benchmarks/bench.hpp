@@ -0,0 +1,235 @@
+#ifndef __BENCHMARKS_BENCH_HPP__
+#define __BENCHMARKS_BENCH_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Shared harness of the benchmark binaries. Every binary accepts
+ *
+ *   --threads N      largest thread count, runs 1, 2, 4 ... N
+ *   --duration MS    length of each run
+ *   --format F       csv (default) or json
+ *
+ * and reports one row per benchmark and thread count with the throughput and
+ * the p50/p99/p999 latency of a sample of the ops.
+ */
+
+struct bench_options {
+  unsigned int max_threads = std::thread::hardware_concurrency();
+  std::chrono::milliseconds duration{500};
+  bool json = false;
+};
+
+inline bench_options parse_options(int argc, char **argv) {
+  bench_options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      options.max_threads = std::max(atoi(argv[i + 1]), 1);
+    } else if (strcmp(argv[i], "--duration") == 0) {
+      options.duration = std::chrono::milliseconds(atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "--format") == 0) {
+      options.json = strcmp(argv[i + 1], "json") == 0;
+    } else {
+      std::cerr << "Unknown option " << argv[i] << "\n";
+    }
+  }
+  return options;
+}
+
+// 1, 2, 4 ... up to and including max.
+inline std::vector<unsigned int> thread_counts(unsigned int max) {
+  std::vector<unsigned int> counts;
+  for (unsigned int threads = 1; threads < max; threads *= 2) {
+    counts.push_back(threads);
+  }
+  counts.push_back(max);
+  return counts;
+}
+
+/* Latencies of the ops of one thread. Reading the clock costs more than most
+ * of the ops measured, so only one op in SAMPLE_INTERVAL is timed.
+ */
+class latency_samples {
+  std::vector<uint64_t> m_samples;
+  unsigned int m_tick = 0;
+
+public:
+  static constexpr unsigned int SAMPLE_INTERVAL = 16;
+
+  latency_samples() { m_samples.reserve(1 << 16); }
+
+  // Check the next op has to be timed.
+  bool sample() noexcept { return (++m_tick & (SAMPLE_INTERVAL - 1)) == 0; }
+
+  void add(std::chrono::steady_clock::duration latency) {
+    m_samples.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+  }
+
+  std::vector<uint64_t> &samples() noexcept { return m_samples; }
+};
+
+struct bench_result {
+  std::string name;
+  unsigned int threads = 0;
+  uint64_t ops         = 0;
+  double seconds       = 0;
+  uint64_t p50         = 0;
+  uint64_t p99         = 0;
+  uint64_t p999        = 0;
+
+  double ops_per_sec() const noexcept {
+    return seconds > 0 ? ops / seconds : 0;
+  }
+};
+
+inline bench_result summarize(const std::string &name, unsigned int threads,
+                              uint64_t ops, double seconds,
+                              std::vector<latency_samples> &latencies) {
+  std::vector<uint64_t> samples;
+  for (auto &latency : latencies) {
+    samples.insert(samples.end(), latency.samples().begin(),
+                   latency.samples().end());
+  }
+
+  bench_result result{name, threads, ops, seconds};
+  if (!samples.empty()) {
+    auto percentile = [&](double p) {
+      auto nth = samples.begin() +
+                 static_cast<size_t>(p * (samples.size() - 1));
+      std::nth_element(samples.begin(), nth, samples.end());
+      return *nth;
+    };
+    result.p50  = percentile(0.50);
+    result.p99  = percentile(0.99);
+    result.p999 = percentile(0.999);
+  }
+  return result;
+}
+
+/* Prints the results, csv rows as they come so that long runs show progress,
+ * json as one array once the report is destroyed.
+ */
+class bench_report {
+  bool m_json;
+  std::vector<bench_result> m_results;
+
+public:
+  explicit bench_report(const bench_options &options) : m_json{options.json} {
+    if (!m_json) {
+      std::cout << "benchmark,threads,ops,ops_per_sec,p50_ns,p99_ns,p999_ns\n";
+    }
+  }
+
+  bench_report(const bench_report &) = delete;
+  bench_report &operator=(const bench_report &) = delete;
+
+  ~bench_report() {
+    if (!m_json) {
+      return;
+    }
+    std::cout << "[\n";
+    for (size_t i = 0; i < m_results.size(); ++i) {
+      auto &r = m_results[i];
+      std::cout << "  {\"benchmark\": \"" << r.name << "\", \"threads\": "
+                << r.threads << ", \"ops\": " << r.ops
+                << ", \"ops_per_sec\": "
+                << static_cast<uint64_t>(r.ops_per_sec())
+                << ", \"p50_ns\": " << r.p50 << ", \"p99_ns\": " << r.p99
+                << ", \"p999_ns\": " << r.p999 << "}"
+                << (i + 1 < m_results.size() ? ",\n" : "\n");
+    }
+    std::cout << "]\n";
+  }
+
+  void add(const bench_result &r) {
+    if (m_json) {
+      m_results.push_back(r);
+      return;
+    }
+    std::cout << r.name << "," << r.threads << "," << r.ops << ","
+              << static_cast<uint64_t>(r.ops_per_sec()) << "," << r.p50 << ","
+              << r.p99 << "," << r.p999 << std::endl;
+  }
+};
+
+/* Run body(thread_index, stop, latencies) on threads threads for the given
+ * duration. body loops until stop is set and returns the number of ops it
+ * did.
+ */
+template <typename Body>
+bench_result run_threads(const std::string &name, unsigned int threads,
+                         std::chrono::milliseconds duration, Body &&body) {
+  std::atomic_bool start{false};
+  std::atomic_bool stop{false};
+  std::vector<uint64_t> ops(threads, 0);
+  std::vector<latency_samples> latencies(threads);
+  std::vector<std::thread> workers;
+
+  for (unsigned int i = 0; i < threads; ++i) {
+    workers.emplace_back([&, i] {
+      while (!start.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      ops[i] = body(i, stop, latencies[i]);
+    });
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(duration);
+  stop.store(true, std::memory_order_relaxed);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  uint64_t total = 0;
+  for (auto &count : ops) {
+    total += count;
+  }
+  return summarize(name, threads, total,
+                   std::chrono::duration<double>(end - begin).count(),
+                   latencies);
+}
+
+/* Run coroutines coroutines made by spawn(stop, latencies) on a scheduler of
+ * threads workers. Each one loops until stop is set and returns the number of
+ * ops it did.
+ */
+template <typename Spawn>
+bench_result run_coroutines(const std::string &name, unsigned int threads,
+                            unsigned int coroutines,
+                            std::chrono::milliseconds duration, Spawn &&spawn) {
+  std::atomic_bool stop{false};
+  std::vector<latency_samples> latencies(coroutines);
+  std::vector<decltype(spawn(stop, latencies[0]))> launched;
+  launched.reserve(coroutines);
+
+  auto begin = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < coroutines; ++i) {
+    launched.push_back(spawn(stop, latencies[i]));
+  }
+  std::this_thread::sleep_for(duration);
+  stop.store(true, std::memory_order_relaxed);
+
+  uint64_t total = 0;
+  for (auto &coroutine : launched) {
+    total += static_cast<uint64_t>(coroutine);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return summarize(name, threads, total,
+                   std::chrono::duration<double>(end - begin).count(),
+                   latencies);
+}
+
+#endif
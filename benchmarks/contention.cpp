@@ -0,0 +1,117 @@
+#include "bench.hpp"
+#include "queue/work_stealing_queue.hpp"
+
+#include <coroutine>
+
+/* One owner and 1, 2 ... N - 1 thieves hammering the same
+ * work_stealing_queue, the layout of the queue decides how often they fight
+ * over a cache line.
+ *
+ * work_stealing_steals : successful steals, the latency is the one of a
+ *                        steal attempt.
+ * work_stealing_batch  : items taken by thieves moving up to batch items
+ *                        per steal_batch() into a deque of their own, the
+ *                        latency is the one of a steal_batch() call.
+ * <name>_owner         : enqueues plus dequeues of the owner of either run,
+ *                        who keeps between depth / 2 and depth items queued.
+ */
+
+constexpr unsigned int depth = 256;
+constexpr unsigned int batch = 32;
+
+using handle_queue = work_stealing_queue<std::coroutine_handle<>>;
+
+uint64_t owner(handle_queue &queue, std::atomic_bool &stop) {
+  // Handles are only stored, never resumed.
+  static char frame;
+  auto handle    = std::coroutine_handle<>::from_address(&frame);
+  uint64_t ops   = 0;
+  unsigned int n = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    queue.enqueue(handle);
+    ++ops;
+    if (++n == depth) {
+      n = 0;
+      while (queue.size() > depth / 2 && queue.dequeue(handle)) {
+        ++ops;
+      }
+    }
+  }
+  return ops;
+}
+
+uint64_t thief(handle_queue &queue, std::atomic_bool &stop,
+               latency_samples &latencies) {
+  std::coroutine_handle<> handle;
+  uint64_t steals = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    bool stolen;
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      stolen     = queue.steal(handle);
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      stolen = queue.steal(handle);
+    }
+    steals += stolen;
+  }
+  return steals;
+}
+
+uint64_t batch_thief(handle_queue &queue, std::atomic_bool &stop,
+                     latency_samples &latencies) {
+  handle_queue own(depth);
+  std::coroutine_handle<> handle;
+  uint64_t taken = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      queue.steal_batch(own, batch);
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      queue.steal_batch(own, batch);
+    }
+    while (own.dequeue(handle)) {
+      ++taken;
+    }
+  }
+  return taken;
+}
+
+// One run of owner against threads - 1 thieves, both rows reported.
+template <typename Thief>
+void contend(bench_report &report, const std::string &name,
+             unsigned int threads, std::chrono::milliseconds duration,
+             Thief &&thief) {
+  handle_queue queue(depth);
+  uint64_t owner_ops = 0;
+  auto taken         = run_threads(
+      name, threads, duration,
+      [&](unsigned int id, std::atomic_bool &stop,
+          latency_samples &latencies) -> uint64_t {
+        if (id == 0) {
+          owner_ops = owner(queue, stop);
+          return 0;
+        }
+        return thief(queue, stop, latencies);
+      });
+  report.add(taken);
+  report.add(
+      bench_result{name + "_owner", threads, owner_ops, taken.seconds});
+}
+
+int main(int argc, char **argv) {
+  bench_options options = parse_options(argc, argv);
+  bench_report report(options);
+
+  for (auto threads : thread_counts(std::max(options.max_threads, 2u))) {
+    if (threads < 2) {
+      continue;
+    }
+    contend(report, "work_stealing_steals", threads, options.duration,
+            thief);
+    contend(report, "work_stealing_batch", threads, options.duration,
+            batch_thief);
+  }
+  return 0;
+}
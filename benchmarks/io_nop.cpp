@@ -0,0 +1,47 @@
+#include "bench.hpp"
+#include "coroutine/launch.hpp"
+#include "coroutine/scheduler/scheduler.hpp"
+#include "io/io_service.hpp"
+
+/* Round trip of a nop through io_service, from submission to the resumption
+ * of the awaiting coroutine, for both ring modes. COROUTINES_PER_THREAD
+ * coroutines per worker each keep one nop in flight.
+ */
+
+constexpr unsigned int COROUTINES_PER_THREAD = 4;
+
+launch<uint64_t> pinger(io_service &io, std::atomic_bool &stop,
+                        latency_samples &latencies) {
+  uint64_t ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      co_await io.nop();
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      co_await io.nop();
+    }
+    ++ops;
+  }
+  co_return ops;
+}
+
+int main(int argc, char **argv) {
+  bench_options options = parse_options(argc, argv);
+  bench_report report(options);
+
+  for (auto mode : {IO_RING_MODE::SHARED, IO_RING_MODE::PER_THREAD}) {
+    const char *name =
+        mode == IO_RING_MODE::SHARED ? "io_nop_shared" : "io_nop_per_thread";
+    for (auto threads : thread_counts(options.max_threads)) {
+      scheduler schd(threads);
+      io_service io(4096, 0, schd, mode);
+      report.add(run_coroutines(
+          name, threads, threads * COROUTINES_PER_THREAD, options.duration,
+          [&](std::atomic_bool &stop, latency_samples &latencies) {
+            return pinger(io, stop, latencies).schedule_on(&schd);
+          }));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include "bench.hpp"
+#include "io/io_service.hpp"
+
+#include <vector>
+
+/* Submission throughput of the shared ring as the number of submitting
+ * threads grows. Each thread keeps at most `window` nops in flight and
+ * waits for them before submitting the next window, so the rate measured is
+ * bounded by the submission path rather than by memory growth. The latency
+ * is the time to submit one nop.
+ */
+
+constexpr unsigned int window = 64;
+
+uint64_t submitter(io_service &io, std::atomic_bool &stop,
+                   latency_samples &latencies) {
+  std::vector<uring_awaiter> awaiters;
+  awaiters.reserve(window);
+  uint64_t submitted = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (unsigned int i = 0; i < window; ++i) {
+      if (latencies.sample()) {
+        auto begin = std::chrono::steady_clock::now();
+        awaiters.push_back(io.nop());
+        latencies.add(std::chrono::steady_clock::now() - begin);
+      } else {
+        awaiters.push_back(io.nop());
+      }
+    }
+    for (auto &awaiter : awaiters) {
+      auto data = awaiter.get_data();
+      while (!data->m_handle_ctl.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+    submitted += awaiters.size();
+    awaiters.clear();
+  }
+  return submitted;
+}
+
+int main(int argc, char **argv) {
+  bench_options options = parse_options(argc, argv);
+  bench_report report(options);
+
+  io_service io(4096, 0);
+
+  for (auto threads : thread_counts(options.max_threads)) {
+    report.add(run_threads("io_submit", threads, options.duration,
+                           [&](unsigned int, std::atomic_bool &stop,
+                               latency_samples &latencies) {
+                             return submitter(io, stop, latencies);
+                           }));
+  }
+  return 0;
+}
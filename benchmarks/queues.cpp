@@ -0,0 +1,166 @@
+#include "bench.hpp"
+#include "queue/injection_queue.hpp"
+#include "queue/io_work_queue.hpp"
+#include "queue/work_stealing_queue.hpp"
+
+#include <coroutine>
+#include <vector>
+
+/* work_stealing_queue : thread 0 owns the queue, pushes a batch and pops it
+ *                       back while the other threads steal from it. Ops are
+ *                       items taken out of the queue by either side.
+ * io_work_queue       : single producer and single consumer, the way an
+ *                       io_op_pipeline is used. Ops are items dequeued.
+ * injection_queue     : thread 0 drains the queue the way a worker does while
+ *                       the other threads push into it like foreign threads
+ *                       scheduling tasks. Ops are items pushed, the latency
+ *                       is the one of a push.
+ */
+
+constexpr unsigned int batch = 64;
+
+using handle_queue = work_stealing_queue<std::coroutine_handle<>>;
+
+uint64_t owner(handle_queue &queue, std::atomic_bool &stop,
+               latency_samples &latencies) {
+  // Handles are only stored, never resumed.
+  static char frames[batch];
+  std::coroutine_handle<> handle;
+  uint64_t taken = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (unsigned int i = 0; i < batch; ++i) {
+      queue.enqueue(std::coroutine_handle<>::from_address(&frames[i]));
+    }
+    while (true) {
+      bool dequeued;
+      if (latencies.sample()) {
+        auto begin = std::chrono::steady_clock::now();
+        dequeued   = queue.dequeue(handle);
+        latencies.add(std::chrono::steady_clock::now() - begin);
+      } else {
+        dequeued = queue.dequeue(handle);
+      }
+      if (!dequeued) {
+        break;
+      }
+      ++taken;
+    }
+  }
+  return taken;
+}
+
+uint64_t thief(handle_queue &queue, std::atomic_bool &stop,
+               latency_samples &latencies) {
+  std::coroutine_handle<> handle;
+  uint64_t taken = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (queue.empty()) {
+      std::this_thread::yield();
+      continue;
+    }
+    bool stolen;
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      stolen     = queue.steal(handle);
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      stolen = queue.steal(handle);
+    }
+    taken += stolen;
+  }
+  return taken;
+}
+
+uint64_t producer(io_work_queue<size_t> &queue, std::atomic_bool &stop) {
+  size_t item = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    // Stay ahead of the consumer without growing the queue forever.
+    for (unsigned int i = 0; i < batch; ++i) {
+      queue.enqueue(size_t(item++));
+    }
+    while (!queue.empty() && !stop.load(std::memory_order_relaxed)) {
+      std::this_thread::yield();
+    }
+  }
+  return 0;
+}
+
+uint64_t consumer(io_work_queue<size_t> &queue, std::atomic_bool &stop,
+                  latency_samples &latencies) {
+  size_t item;
+  uint64_t taken = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    bool dequeued;
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      dequeued   = queue.dequeue(item);
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      dequeued = queue.dequeue(item);
+    }
+    if (!dequeued) {
+      std::this_thread::yield();
+    }
+    taken += dequeued;
+  }
+  return taken;
+}
+
+uint64_t injector(injection_queue<size_t> &queue, std::atomic_bool &stop,
+                  latency_samples &latencies) {
+  uint64_t pushed = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      queue.push(pushed);
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      queue.push(pushed);
+    }
+    ++pushed;
+  }
+  return pushed;
+}
+
+uint64_t drainer(injection_queue<size_t> &queue, std::atomic_bool &stop) {
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (queue.pop_all([](size_t &) {}) == 0) {
+      std::this_thread::yield();
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  bench_options options = parse_options(argc, argv);
+  bench_report report(options);
+
+  for (auto threads : thread_counts(options.max_threads)) {
+    handle_queue queue(batch);
+    report.add(run_threads("work_stealing_queue", threads, options.duration,
+                           [&](unsigned int id, std::atomic_bool &stop,
+                               latency_samples &latencies) {
+                             return id == 0 ? owner(queue, stop, latencies)
+                                            : thief(queue, stop, latencies);
+                           }));
+  }
+
+  for (auto threads : thread_counts(options.max_threads)) {
+    injection_queue<size_t> queue;
+    report.add(run_threads("injection_queue", threads + 1, options.duration,
+                           [&](unsigned int id, std::atomic_bool &stop,
+                               latency_samples &latencies) {
+                             return id == 0 ? drainer(queue, stop)
+                                            : injector(queue, stop, latencies);
+                           }));
+  }
+
+  io_work_queue<size_t> queue(batch * 2);
+  report.add(run_threads("io_work_queue", 2, options.duration,
+                         [&](unsigned int id, std::atomic_bool &stop,
+                             latency_samples &latencies) {
+                           return id == 0 ? producer(queue, stop)
+                                          : consumer(queue, stop, latencies);
+                         }));
+  return 0;
+}
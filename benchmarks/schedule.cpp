@@ -0,0 +1,56 @@
+#include "bench.hpp"
+#include "coroutine/launch.hpp"
+#include "coroutine/scheduler/scheduler.hpp"
+
+/* scheduler::schedule followed by get_next_coroutine, the path every resumed
+ * coroutine takes. COROUTINES_PER_THREAD coroutines per worker keep
+ * rescheduling themselves, the latency is the time from schedule to resume.
+ */
+
+constexpr unsigned int COROUTINES_PER_THREAD = 4;
+
+struct reschedule {
+  scheduler *m_scheduler = nullptr;
+
+  bool await_ready() const noexcept { return false; }
+
+  auto await_suspend(const std::coroutine_handle<> &handle) noexcept
+      -> std::coroutine_handle<> {
+    m_scheduler->schedule(handle);
+    return m_scheduler->get_next_coroutine();
+  }
+
+  void await_resume() const noexcept {}
+
+  void via(scheduler *s) { m_scheduler = s; }
+};
+
+launch<uint64_t> yielder(std::atomic_bool &stop, latency_samples &latencies) {
+  uint64_t ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (latencies.sample()) {
+      auto begin = std::chrono::steady_clock::now();
+      co_await reschedule{};
+      latencies.add(std::chrono::steady_clock::now() - begin);
+    } else {
+      co_await reschedule{};
+    }
+    ++ops;
+  }
+  co_return ops;
+}
+
+int main(int argc, char **argv) {
+  bench_options options = parse_options(argc, argv);
+  bench_report report(options);
+
+  for (auto threads : thread_counts(options.max_threads)) {
+    scheduler schd(threads);
+    report.add(run_coroutines(
+        "schedule", threads, threads * COROUTINES_PER_THREAD, options.duration,
+        [&](std::atomic_bool &stop, latency_samples &latencies) {
+          return yielder(stop, latencies).schedule_on(&schd);
+        }));
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include "coroutine/launch.hpp"
 #include "coroutine/scheduler/scheduler.hpp"
 #include "coroutine/task.hpp"
+#include "io/buffer_arena.hpp"
 #include "io/io_service.hpp"
 
 #include <cstdlib>
@@ -15,30 +16,32 @@
 
 using io = io_service;
 
-char *send_buffer;
-char *read_buffer;
+buffer_arena *arena;
+fixed_buffer send_buffer;
 
 size_t sb_len;
-size_t rb_len;
 
 int get_tcp_socket();
 
 task<> fill_response_from_file(io *io) {
   int dfd = open(".", 0);
   int fd  = co_await io->openat(dfd, "response", 0, 0);
-  sb_len  = co_await io->read_fixed(fd, send_buffer, 1024, 0, 0);
+  send_buffer = arena->allocate(1024);
+  sb_len      = co_await io->read_fixed(fd, send_buffer, 1024, 0);
   co_await io->close(fd);
 }
 
 async<> handle_client(int fd, io *io) {
+  // Every connection reads into its own registered buffer.
+  auto read_buffer = arena->allocate(1024);
 
   while (true) {
-    auto r = co_await io->read_fixed(fd, read_buffer, rb_len, 0, 1);
+    auto r = co_await io->read_fixed(fd, read_buffer, 1024, 0);
     if (r <= 0) {
       co_await io->close(fd);
       co_return;
     }
-    co_await io->write_fixed(fd, send_buffer, sb_len, 0, 0);
+    co_await io->write_fixed(fd, send_buffer, sb_len, 0);
   }
 
   co_return;
@@ -50,19 +53,21 @@ generator<int> get_connections(io *io, int socket_fd) {
   // Get a stop_token for this coroutine.
   auto st = co_await get_stop_token();
   while (!st.stop_requested()) { // Run untill a cancel is requested.
-    sockaddr_in client_addr;
-    socklen_t client_length;
 
-    // Submit an io request for accepting a connection.
-    auto awaiter =
-        io->accept(socket_fd, (sockaddr *)&client_addr, &client_length, 0);
+    // Submit a single multishot accept, it completes once per connection.
+    auto connections = io->accept_multishot(socket_fd, 0);
 
     // Register a stop_callback for this coroutine.
-    std::stop_callback sc(st, [&] { io->cancel(awaiter, 0); });
-
-    // Suspend this coroutine till a connection is received and yield the
-    // connection fd.
-    co_yield co_await awaiter;
+    std::stop_callback sc(st, [&] { connections.cancel(); });
+
+    // Yield every connection fd, the stream ends on cancel or on an error in
+    // which case the accept is armed again.
+    while (connections) {
+      int fd = co_await connections;
+      if (fd >= 0) {
+        co_yield fd;
+      }
+    }
   }
   co_yield 0;
 }
@@ -105,22 +110,14 @@ int main(int argc, char **argv) {
   scheduler scheduler;
   io io(1000, 0);
 
-  rb_len      = 1024;
-  send_buffer = new char[1024];
-  read_buffer = new char[rb_len];
-
-  iovec vec[2];
-  vec[0].iov_base = send_buffer;
-  vec[0].iov_len  = 1024;
-  vec[1].iov_base = read_buffer;
-  vec[1].iov_len  = 1024;
-
-  if (!io.register_buffer(vec)) {
-    std::cerr << "Buffer Registeration failed\n";
-  }
+  // Registered memory handed out as fixed buffers, no indices to manage.
+  buffer_arena buffers(io);
+  arena = &buffers;
 
   start_accept(&io).schedule_on(&scheduler).join();
 
+  send_buffer.release();
+
   return 0;
 }
 
@@ -0,0 +1,67 @@
+#include "coroutine/async.hpp"
+#include "coroutine/launch.hpp"
+#include "coroutine/scheduler/scheduler.hpp"
+#include "io/io_service.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+
+async<int> read_file(io_service &io, int dir, const char *filename) {
+  char buffer[256]{0};
+  int fd  = co_await io.openat(dir, filename, 0, 0);
+  int len = co_await io.read(fd, buffer, 256, 0);
+  co_await io.close(fd);
+  co_return len;
+}
+
+// Round trip nop requests to compare the cost of a completion in each mode.
+async<int> nop_loop(io_service &io, int count) {
+  for (int i = 0; i < count; ++i) {
+    co_await io.nop();
+  }
+  co_return count;
+}
+
+launch<int> coroutine_1(io_service &io, int dir) {
+  auto schd = co_await get_scheduler();
+  auto len  = read_file(io, dir, "log").schedule_on(schd);
+
+  auto start = std::chrono::steady_clock::now();
+  auto nops  = nop_loop(io, 100000).schedule_on(schd);
+  int count  = co_await nops;
+  auto end   = std::chrono::steady_clock::now();
+
+  std::cout << count << " nops in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(end -
+                                                                      start)
+                   .count()
+            << "us\n";
+
+  co_return co_await len;
+}
+
+int main(int argc, char **argv) {
+  scheduler scheduler;
+
+  // Pass "shared" to run the same load on the single ring + CQ thread, or
+  // "sqpoll" to let a kernel thread pick up the submissions.
+  auto mode = (argc == 2 && strcmp(argv[1], "shared") == 0)
+                  ? IO_RING_MODE::SHARED
+                  : IO_RING_MODE::PER_THREAD;
+  bool sqpoll = argc == 2 && strcmp(argv[1], "sqpoll") == 0;
+
+  auto io = sqpoll ? std::make_unique<io_service>(256, sqpoll_config{},
+                                                  scheduler, mode)
+                   : std::make_unique<io_service>(256, 0, scheduler, mode);
+
+  int dir = open(".", 0);
+  int len = coroutine_1(*io, dir).schedule_on(&scheduler);
+  std::cout << "File Length : " << len << std::endl;
+  if (io->sqpoll()) {
+    std::cout << "SQ thread wakeups : " << io->sqpoll_wakeups() << std::endl;
+  }
+
+  return 0;
+}
@@ -1,10 +1,14 @@
 #ifndef __COROUTINE_AWAITER_HPP__
 #define __COROUTINE_AWAITER_HPP__
 
+#include "frame_allocator.hpp"
 #include "scheduler/scheduler.hpp"
 
 #include <concepts>
+#include <functional>
 #include <stop_token>
+#include <type_traits>
+#include <utility>
 
 template <typename T>
 concept Resume_VIA = requires(T a, scheduler *s) {
@@ -31,6 +35,85 @@ struct get_stop_token {
   }
 };
 
+// Let every other task queued on this worker run before resuming.
+struct yield {
+  scheduler *m_scheduler = nullptr;
+
+  constexpr bool await_ready() const noexcept { return false; }
+
+  auto await_suspend(const std::coroutine_handle<> &handle) noexcept
+      -> std::coroutine_handle<> {
+    m_scheduler->defer(handle);
+    return m_scheduler->get_next_coroutine();
+  }
+
+  constexpr void await_resume() const noexcept {}
+
+  void via(scheduler *s) { m_scheduler = s; }
+};
+
+/* Run function on the calling worker as a blocking section, the scheduler
+ * spawns a worker in its place if too few are left to run tasks. Use it for
+ * syscalls and libraries that block, co_await blocking([] { ... }) returns
+ * what function returns.
+ */
+template <typename Function>
+class blocking {
+  using Return = std::invoke_result_t<Function &>;
+
+  Function m_function;
+  scheduler *m_scheduler = nullptr;
+
+public:
+  explicit blocking(Function function) : m_function{std::move(function)} {}
+
+  constexpr bool await_ready() const noexcept { return true; }
+
+  constexpr void await_suspend(const std::coroutine_handle<> &) const noexcept {
+  }
+
+  Return await_resume() {
+    struct section {
+      scheduler *m_scheduler;
+      explicit section(scheduler *s) : m_scheduler{s} {
+        if (m_scheduler != nullptr) {
+          m_scheduler->begin_blocking();
+        }
+      }
+      ~section() {
+        if (m_scheduler != nullptr) {
+          m_scheduler->end_blocking();
+        }
+      }
+    } guard{m_scheduler};
+    return std::invoke(m_function);
+  }
+
+  void via(scheduler *s) { m_scheduler = s; }
+};
+
+/* Reschedule the calling coroutine on the lane of priority, letting other
+ * tasks run first. The coroutine stays on that lane from then on.
+ */
+struct yield_to {
+  PRIORITY m_priority;
+  scheduler *m_scheduler = nullptr;
+
+  explicit yield_to(PRIORITY priority) : m_priority{priority} {}
+
+  constexpr bool await_ready() const noexcept { return false; }
+
+  auto await_suspend(const std::coroutine_handle<> &handle) noexcept
+      -> std::coroutine_handle<> {
+    m_scheduler->schedule(handle, m_priority);
+    return m_scheduler->get_next_coroutine();
+  }
+
+  constexpr void await_resume() const noexcept {}
+
+  void via(scheduler *s) { m_scheduler = s; }
+};
+
 template <typename Promise>
 struct cancel_awaiter {
   Promise *m_promise;
@@ -56,6 +139,16 @@ struct Awaiter_Transforms {
   std::coroutine_handle<> m_cancel_continuation;
   std::stop_source m_stop_source;
   std::atomic_bool m_cancel_handle_ctl{false};
+
+  // Coroutine frames come from the frame allocator rather than malloc.
+  static void *operator new(size_t size) {
+    return frame_allocator::allocate(size);
+  }
+
+  static void operator delete(void *ptr, size_t size) noexcept {
+    frame_allocator::deallocate(ptr, size);
+  }
+
   template <Resume_VIA A>
   A &await_transform(A &awaiter) {
     awaiter.via(m_scheduler);
@@ -21,7 +21,7 @@ struct async_awaiter {
       -> std::coroutine_handle<> {
     m_promise->m_continuation = handle;
     if (m_promise->m_handle_ctl.exchange(true, std::memory_order_acq_rel)) {
-      return handle;
+      return m_promise->m_scheduler->transfer_to(handle);
     }
     return m_promise->m_scheduler->get_next_coroutine();
   }
@@ -47,7 +47,7 @@ struct async_awaiter<Promise, void> {
       -> std::coroutine_handle<> {
     m_promise->m_continuation = handle;
     if (m_promise->m_handle_ctl.exchange(true, std::memory_order_acq_rel)) {
-      return handle;
+      return m_promise->m_scheduler->transfer_to(handle);
     }
     return m_promise->m_scheduler->get_next_coroutine();
   }
@@ -69,6 +69,7 @@ struct async_final_suspend {
 
   auto await_suspend(const std::coroutine_handle<> &handle) const noexcept
       -> std::coroutine_handle<> {
+    m_promise->m_root.release();
 
     if (m_promise->m_cancel_handle_ctl.exchange(true,
                                                 std::memory_order_acquire)) {
@@ -78,7 +79,8 @@ struct async_final_suspend {
     std::coroutine_handle<> continuation;
     if (m_promise->m_handle_ctl.exchange(true, std::memory_order_acq_rel)) {
       if (m_promise->m_continuation_scheduler == m_promise->m_scheduler) {
-        continuation = m_promise->m_continuation;
+        continuation =
+            m_promise->m_scheduler->transfer_to(m_promise->m_continuation);
       } else {
         m_promise->m_continuation_scheduler->schedule(
             m_promise->m_continuation);
@@ -107,6 +109,7 @@ struct async {
     std::coroutine_handle<> m_continuation;
     std::atomic_bool m_handle_ctl{false};
     std::atomic_bool m_destroy_ctl{false};
+    scheduler_root m_root;
 
     std::suspend_always initial_suspend() const noexcept { return {}; }
 
@@ -151,16 +154,29 @@ struct async {
   auto schedule_on(scheduler *s) {
     if (this->m_promise->m_scheduler == nullptr) {
       this->m_promise->m_scheduler = s;
+      s->track(*m_promise);
       s->schedule(
           std::coroutine_handle<promise_type>::from_promise(*m_promise));
     }
     return async_awaiter<promise_type, Return>{m_promise};
   }
 
+  auto schedule_on(scheduler *s, PRIORITY priority) {
+    if (this->m_promise->m_scheduler == nullptr) {
+      this->m_promise->m_scheduler = s;
+      s->track(*m_promise);
+      s->schedule(
+          std::coroutine_handle<promise_type>::from_promise(*m_promise),
+          priority);
+    }
+    return async_awaiter<promise_type, Return>{m_promise};
+  }
+
   void via(scheduler *s) {
     this->m_promise->m_continuation_scheduler = s;
     if (this->m_promise->m_scheduler == nullptr) {
       this->m_promise->m_scheduler = s;
+      s->track(*m_promise);
       s->schedule(
           std::coroutine_handle<promise_type>::from_promise(*m_promise));
     }
@@ -180,6 +196,7 @@ struct async<void> {
     scheduler *m_continuation_scheduler{nullptr};
     std::atomic_bool m_handle_ctl{false};
     std::atomic_bool m_destroy_ctl{false};
+    scheduler_root m_root;
 
     std::suspend_always initial_suspend() const noexcept { return {}; }
 
@@ -222,12 +239,24 @@ struct async<void> {
   auto schedule_on(scheduler *s) {
     if (this->m_promise->m_scheduler == nullptr) {
       this->m_promise->m_scheduler = s;
+      s->track(*m_promise);
       s->schedule(
           std::coroutine_handle<promise_type>::from_promise(*m_promise));
     }
     return async_awaiter<promise_type, void>{m_promise};
   }
 
+  auto schedule_on(scheduler *s, PRIORITY priority) {
+    if (this->m_promise->m_scheduler == nullptr) {
+      this->m_promise->m_scheduler = s;
+      s->track(*m_promise);
+      s->schedule(
+          std::coroutine_handle<promise_type>::from_promise(*m_promise),
+          priority);
+    }
+    return async_awaiter<promise_type, void>{m_promise};
+  }
+
   auto cancel() {
     m_promise->m_stop_source.request_stop();
     return cancel_awaiter<promise_type>(m_promise);
@@ -237,6 +266,7 @@ struct async<void> {
     this->m_promise->m_continuation_scheduler = s;
     if (this->m_promise->m_scheduler == nullptr) {
       this->m_promise->m_scheduler = s;
+      s->track(*m_promise);
       s->schedule(
           std::coroutine_handle<promise_type>::from_promise(*m_promise));
     }
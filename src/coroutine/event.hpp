@@ -25,7 +25,7 @@ class event {
       if (m_promise->m_event_count.load(std::memory_order_relaxed)) {
         if (m_promise->m_handle_ctl.exchange(false,
                                              std::memory_order_relaxed)) {
-          return handle;
+          return m_promise->m_scheduler->transfer_to(handle);
         }
       }
       return m_promise->m_scheduler->get_next_coroutine();
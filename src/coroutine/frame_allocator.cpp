@@ -0,0 +1,241 @@
+#include "frame_allocator.hpp"
+#include "queue/cache_line.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+namespace {
+
+constexpr size_t SLAB_SIZE    = 64 * 1024;
+constexpr size_t CLASS_SIZE   = 64;
+constexpr size_t SIZE_CLASSES = 32;
+constexpr size_t MAX_FRAME    = CLASS_SIZE * SIZE_CLASSES;
+
+struct free_frame {
+  free_frame *m_next;
+};
+
+struct frame_cache;
+
+// Start of every slab, a frame finds its cache by masking its address.
+struct slab_header {
+  frame_cache *m_cache;
+  slab_header *m_next;
+};
+
+static_assert(sizeof(slab_header) <= CLASS_SIZE);
+
+// Counters are written by the owner of a cache only.
+void count(std::atomic_uint64_t &counter, uint64_t n = 1) noexcept {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+struct alignas(CACHE_LINE_SIZE) frame_cache {
+  // Owner only.
+  std::array<free_frame *, SIZE_CLASSES> m_free{};
+  char *m_bump         = nullptr;
+  char *m_end          = nullptr;
+  slab_header *m_slabs = nullptr;
+
+  // Frames freed by other threads, one list per size class.
+  alignas(CACHE_LINE_SIZE)
+      std::array<std::atomic<free_frame *>, SIZE_CLASSES> m_remote{};
+
+  alignas(CACHE_LINE_SIZE) std::atomic_uint64_t m_allocations{0};
+  std::atomic_uint64_t m_deallocations{0};
+  std::atomic_uint64_t m_remote_deallocations{0};
+  std::atomic_uint64_t m_slab_count{0};
+  std::atomic_uint64_t m_large_allocations{0};
+
+  // Every cache ever created, and those whose thread exited.
+  frame_cache *m_next_cache  = nullptr;
+  frame_cache *m_next_orphan = nullptr;
+
+  // Take a frame of class index when the own list is empty.
+  free_frame *refill(size_t index) {
+    free_frame *frame = nullptr;
+    if (m_remote[index].load(std::memory_order_relaxed) != nullptr) {
+      // Only ever taken as a whole, there is no ABA problem.
+      frame = m_remote[index].exchange(nullptr, std::memory_order_acquire);
+      m_free[index] = frame->m_next;
+      return frame;
+    }
+
+    size_t size = (index + 1) * CLASS_SIZE;
+    if (static_cast<size_t>(m_end - m_bump) < size) [[unlikely]] {
+      // The tail of the old slab is lost, at most one frame.
+      char *slab = static_cast<char *>(
+          ::operator new(SLAB_SIZE, std::align_val_t{SLAB_SIZE}));
+      auto *header    = reinterpret_cast<slab_header *>(slab);
+      header->m_cache = this;
+      header->m_next  = m_slabs;
+      m_slabs         = header;
+      m_bump          = slab + CLASS_SIZE;
+      m_end           = slab + SLAB_SIZE;
+      count(m_slab_count);
+    }
+    frame = reinterpret_cast<free_frame *>(m_bump);
+    m_bump += size;
+    return frame;
+  }
+
+  void *allocate(size_t index) {
+    count(m_allocations);
+    free_frame *frame = m_free[index];
+    if (frame != nullptr) [[likely]] {
+      m_free[index] = frame->m_next;
+      return frame;
+    }
+    return refill(index);
+  }
+};
+
+std::mutex caches_mutex;
+frame_cache *caches  = nullptr;
+frame_cache *orphans = nullptr;
+
+// Counts of threads that already gave their cache up.
+std::atomic_uint64_t uncached_allocations{0};
+std::atomic_uint64_t uncached_deallocations{0};
+std::atomic_uint64_t uncached_remote_deallocations{0};
+std::atomic_uint64_t uncached_large_allocations{0};
+
+// Reuse the cache of an exited thread, its frames may still be in use.
+frame_cache *acquire_cache() {
+  std::unique_lock lk(caches_mutex);
+  frame_cache *cache = orphans;
+  if (cache != nullptr) {
+    orphans = cache->m_next_orphan;
+    return cache;
+  }
+  cache               = new frame_cache;
+  cache->m_next_cache = caches;
+  caches              = cache;
+  return cache;
+}
+
+void release_cache(frame_cache *cache) {
+  std::unique_lock lk(caches_mutex);
+  cache->m_next_orphan = orphans;
+  orphans              = cache;
+}
+
+thread_local frame_cache *thread_cache = nullptr;
+thread_local bool thread_exited        = false;
+
+/* Hands the cache over once the thread exits. The fast paths read
+ * thread_cache, which needs no guard as it has no destructor.
+ */
+struct cache_owner {
+  frame_cache *m_cache = nullptr;
+
+  ~cache_owner() {
+    if (m_cache != nullptr) {
+      release_cache(m_cache);
+    }
+    thread_cache  = nullptr;
+    thread_exited = true;
+  }
+};
+
+thread_local cache_owner thread_cache_owner;
+
+frame_cache *local_cache() {
+  if (thread_cache == nullptr && !thread_exited) [[unlikely]] {
+    thread_cache               = acquire_cache();
+    thread_cache_owner.m_cache = thread_cache;
+  }
+  return thread_cache;
+}
+
+size_t size_class(size_t size) noexcept { return (size - 1) / CLASS_SIZE; }
+
+} // namespace
+
+void *frame_allocator::allocate(size_t size) {
+  frame_cache *cache = local_cache();
+  if (size > MAX_FRAME) [[unlikely]] {
+    if (cache != nullptr) {
+      count(cache->m_allocations);
+      count(cache->m_large_allocations);
+    } else {
+      uncached_allocations.fetch_add(1, std::memory_order_relaxed);
+      uncached_large_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ::operator new(size);
+  }
+  if (cache == nullptr) [[unlikely]] {
+    // A thread local destructor running after ours, borrow a cache.
+    cache       = acquire_cache();
+    void *frame = cache->allocate(size_class(size));
+    release_cache(cache);
+    return frame;
+  }
+  return cache->allocate(size_class(size));
+}
+
+void frame_allocator::deallocate(void *ptr, size_t size) noexcept {
+  frame_cache *cache = thread_cache;
+  if (size > MAX_FRAME) [[unlikely]] {
+    if (cache != nullptr) {
+      count(cache->m_deallocations);
+    } else {
+      uncached_deallocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    ::operator delete(ptr);
+    return;
+  }
+
+  auto *slab = reinterpret_cast<slab_header *>(
+      reinterpret_cast<uintptr_t>(ptr) & ~(SLAB_SIZE - 1));
+  frame_cache *owner = slab->m_cache;
+  size_t index       = size_class(size);
+  auto *frame        = static_cast<free_frame *>(ptr);
+
+  if (owner == cache) [[likely]] {
+    frame->m_next        = cache->m_free[index];
+    cache->m_free[index] = frame;
+    count(cache->m_deallocations);
+    return;
+  }
+
+  frame->m_next = owner->m_remote[index].load(std::memory_order_relaxed);
+  while (!owner->m_remote[index].compare_exchange_weak(
+      frame->m_next, frame, std::memory_order_release,
+      std::memory_order_relaxed)) {
+  }
+  if (cache != nullptr) {
+    count(cache->m_deallocations);
+    count(cache->m_remote_deallocations);
+  } else {
+    uncached_deallocations.fetch_add(1, std::memory_order_relaxed);
+    uncached_remote_deallocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+frame_allocator_stats frame_allocator::stats() {
+  frame_allocator_stats stats;
+  stats.allocations   = uncached_allocations.load(std::memory_order_relaxed);
+  stats.deallocations = uncached_deallocations.load(std::memory_order_relaxed);
+  stats.remote_deallocations =
+      uncached_remote_deallocations.load(std::memory_order_relaxed);
+  stats.large_allocations =
+      uncached_large_allocations.load(std::memory_order_relaxed);
+
+  std::unique_lock lk(caches_mutex);
+  for (frame_cache *cache = caches; cache; cache = cache->m_next_cache) {
+    stats.allocations += cache->m_allocations.load(std::memory_order_relaxed);
+    stats.deallocations +=
+        cache->m_deallocations.load(std::memory_order_relaxed);
+    stats.remote_deallocations +=
+        cache->m_remote_deallocations.load(std::memory_order_relaxed);
+    stats.slabs += cache->m_slab_count.load(std::memory_order_relaxed);
+    stats.large_allocations +=
+        cache->m_large_allocations.load(std::memory_order_relaxed);
+    ++stats.caches;
+  }
+  return stats;
+}
@@ -0,0 +1,42 @@
+#ifndef __CORO_FRAME_ALLOCATOR_HPP__
+#define __CORO_FRAME_ALLOCATOR_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+struct frame_allocator_stats {
+  // Frames handed out and given back, remote ones were freed by a thread
+  // other than the one whose cache they came from.
+  uint64_t allocations          = 0;
+  uint64_t deallocations        = 0;
+  uint64_t remote_deallocations = 0;
+
+  // Calls into the global allocator: slabs carved into frames, and frames
+  // too large for a size class.
+  uint64_t slabs             = 0;
+  uint64_t large_allocations = 0;
+
+  // Thread caches ever created, a cache of an exited thread is reused.
+  unsigned int caches = 0;
+};
+
+/* Allocator of the coroutine frames, used by every promise through
+ * Awaiter_Transforms.
+ *
+ * Frames are rounded up to a multiple of 64 bytes, up to 2 KiB, and carved
+ * from 64 KiB slabs owned by the cache of the allocating thread. A thread
+ * allocates from and frees to its own cache without any atomic. A frame
+ * freed on another thread, the usual case for a stolen task, is pushed onto
+ * a lock free list of its owning cache, which takes the whole list back once
+ * its own list of that size runs dry. Larger frames go to operator new.
+ */
+class frame_allocator {
+public:
+  static void *allocate(size_t size);
+  static void deallocate(void *ptr, size_t size) noexcept;
+
+  // Counters of every cache.
+  static frame_allocator_stats stats();
+};
+
+#endif
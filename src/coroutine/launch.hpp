@@ -11,14 +11,21 @@
 #include <iostream>
 #include <type_traits>
 
+template <typename Promise>
 struct launch_final_awaiter {
-  std::atomic_bool &m_destroy_ctl;
+  Promise *m_promise;
   constexpr bool await_ready() const noexcept { return false; }
 
-  void await_suspend(std::coroutine_handle<> handle) noexcept {
-    if (m_destroy_ctl.exchange(true, std::memory_order_relaxed)) {
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> handle) const noexcept {
+    m_promise->m_root.release();
+    // Hand the thread back to the scheduler instead of returning to the
+    // resumer, otherwise the worker loop that resumed us would be left.
+    auto continuation = m_promise->m_scheduler->get_next_coroutine();
+    if (m_promise->m_destroy_ctl.exchange(true, std::memory_order_relaxed)) {
       handle.destroy();
     }
+    return continuation;
   }
   constexpr void await_resume() const noexcept {}
 };
@@ -28,9 +35,12 @@ struct launch {
   struct promise_type : public Awaiter_Transforms {
     std::promise<Return> m_result;
     std::atomic_bool m_destroy_ctl;
+    scheduler_root m_root;
 
     std::suspend_always initial_suspend() noexcept { return {}; }
-    launch_final_awaiter final_suspend() noexcept { return {m_destroy_ctl}; }
+    auto final_suspend() noexcept {
+      return launch_final_awaiter<promise_type>{this};
+    }
 
     void return_value(const Return &value) {
       m_result.set_value(std::move(value));
@@ -69,11 +79,21 @@ struct launch {
 
   launch<Return> &&schedule_on(scheduler *schd) {
     m_promise->m_scheduler = schd;
+    schd->track(*m_promise);
     schd->schedule(
         std::coroutine_handle<promise_type>::from_promise(*m_promise));
     return std::move(*this);
   }
 
+  launch<Return> &&schedule_on(scheduler *schd, PRIORITY priority) {
+    m_promise->m_scheduler = schd;
+    schd->track(*m_promise);
+    schd->schedule(
+        std::coroutine_handle<promise_type>::from_promise(*m_promise),
+        priority);
+    return std::move(*this);
+  }
+
   auto cancel() { this->m_promise->m_stop_source.request_stop(); }
 
 private:
@@ -85,9 +105,12 @@ struct launch<void> {
   struct promise_type : public Awaiter_Transforms {
     std::promise<int> m_result;
     std::atomic_bool m_destroy_ctl;
+    scheduler_root m_root;
 
     std::suspend_always initial_suspend() noexcept { return {}; }
-    launch_final_awaiter final_suspend() noexcept { return {m_destroy_ctl}; }
+    auto final_suspend() noexcept {
+      return launch_final_awaiter<promise_type>{this};
+    }
 
     void return_void() { m_result.set_value(0); }
 
@@ -122,11 +145,21 @@ struct launch<void> {
 
   launch<void> &&schedule_on(scheduler *schd) {
     m_promise->m_scheduler = schd;
+    schd->track(*m_promise);
     schd->schedule(
         std::coroutine_handle<promise_type>::from_promise(*m_promise));
     return std::move(*this);
   }
 
+  launch<void> &&schedule_on(scheduler *schd, PRIORITY priority) {
+    m_promise->m_scheduler = schd;
+    schd->track(*m_promise);
+    schd->schedule(
+        std::coroutine_handle<promise_type>::from_promise(*m_promise),
+        priority);
+    return std::move(*this);
+  }
+
   auto cancel() { this->m_promise->m_stop_source.request_stop(); }
 
 private:
@@ -0,0 +1,31 @@
+#ifndef __CORO_SCHEDULER_POLLABLE_HPP__
+#define __CORO_SCHEDULER_POLLABLE_HPP__
+
+#include <chrono>
+
+/* A completion source that is driven by the scheduler worker threads.
+ * Workers call poll() from their idle loop (and periodically while busy) so
+ * that completions owned by the calling thread are reaped on that thread.
+ */
+class pollable {
+public:
+  virtual ~pollable() = default;
+
+  // Flush pending submissions and reap the completions owned by the calling
+  // thread. Returns the number of completions handled.
+  virtual unsigned int poll() noexcept = 0;
+
+  // Check the calling thread has work in flight that a later poll() will
+  // complete, in which case the worker must not park.
+  virtual bool pending() const noexcept = 0;
+
+  /* Block the calling thread until one of its completions is ready, wake_fd
+   * (an eventfd) is signaled or the timeout expires. Returns false if the
+   * source can not block, the worker then keeps polling instead.
+   */
+  virtual bool wait(int, const std::chrono::nanoseconds &) noexcept {
+    return false;
+  }
+};
+
+#endif
@@ -1,67 +1,874 @@
 #include "scheduler.hpp"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <thread>
+#include <unistd.h>
 
 thread_local unsigned int scheduler::m_thread_id         = 0;
 thread_local unsigned int scheduler::m_coro_scheduler_id = 0;
+thread_local unsigned int scheduler::m_poll_tick         = 0;
+thread_local PRIORITY scheduler::m_priority              = PRIORITY::NORMAL;
+thread_local std::chrono::steady_clock::time_point scheduler::m_slice_start;
 unsigned int scheduler::m_coro_scheduler_count           = 0;
+thread_local std::vector<unsigned int> scheduler::m_victims;
+thread_local unsigned int scheduler::m_local_victims   = 0;
+thread_local unsigned int scheduler::m_victims_threads = 0;
 
-scheduler::scheduler() {
-  m_id = ++m_coro_scheduler_count;
-  m_thread_cxts.reserve(128);
-  thread_context *io_cxt = new thread_context;
-  io_cxt->m_tasks        = new task_queue(64);
-  m_thread_cxts.push_back(io_cxt);
-  spawn_workers(std::thread::hardware_concurrency());
+scheduler::scheduler()
+    : scheduler(std::thread::hardware_concurrency(),
+                2 * std::thread::hardware_concurrency()) {}
+
+scheduler::scheduler(unsigned int threads) : scheduler(threads, 2 * threads) {}
+
+scheduler::scheduler(const placement_config &placement) {
+  init_placement(placement);
+  unsigned int threads = m_placement.empty()
+                             ? std::thread::hardware_concurrency()
+                             : m_placement.size();
+  init(threads, 2 * threads);
+}
+
+scheduler::scheduler(unsigned int min_threads, unsigned int max_threads,
+                     const placement_config &placement) {
+  init_placement(placement);
+  init(min_threads, max_threads);
+}
+
+void scheduler::init_placement(const placement_config &placement) {
+  m_thread_name = placement.name.empty() ? "zero-worker" : placement.name;
+  switch (placement.policy) {
+  case PLACEMENT::TOPOLOGY:
+    for (size_t i = 0; i < m_topology.size(); ++i) {
+      m_placement.push_back(m_topology.slot(i));
+    }
+    break;
+  case PLACEMENT::PHYSICAL_CORES:
+    for (size_t i = 0; i < m_topology.size(); ++i) {
+      if (m_topology.slot(i).m_sibling == 0) {
+        m_placement.push_back(m_topology.slot(i));
+      }
+    }
+    break;
+  case PLACEMENT::CPUSET:
+    for (int cpu : placement.cpus) {
+      m_placement.push_back(cpu_topology::describe(cpu));
+    }
+    if (m_placement.empty()) {
+      std::cerr << "Empty cpuset, workers are not pinned\n";
+    }
+    break;
+  case PLACEMENT::NONE:
+    break;
+  }
+}
+
+void scheduler::init(unsigned int min_threads, unsigned int max_threads) {
+  m_id          = ++m_coro_scheduler_count;
+  m_max_threads = std::max({max_threads, min_threads, 1u});
+  m_thread_cxts.resize(m_max_threads + 1, nullptr);
+  // Context 0 stands for foreign threads, they have no deques.
+  m_thread_cxts[0] = new thread_context;
+  spawn_workers(min_threads);
 }
 
 scheduler::~scheduler() {
-  m_stop_requested = true;
-  m_task_wait_flag.test_and_set(std::memory_order_relaxed);
-  m_task_wait_flag.notify_all();
-  for (auto &t_cxt : this->m_thread_cxts) {
-    if (t_cxt->m_thread.joinable())
-      t_cxt->m_thread.join();
+  // The worker would join itself and free the context it runs on.
+  if (is_worker_thread()) {
+    std::cerr << "scheduler destroyed from one of its workers\n";
+    std::abort();
+  }
+  /* A root suspended once nothing runs any more waits on io, a timer or a
+   * channel nobody will send on, it does not hold up the drain. Tasks that
+   * keep yielding, or block, are stopped at the deadline.
+   */
+  SHUTDOWN mode = SHUTDOWN::DRAIN;
+  if (!m_shut_down.load(std::memory_order_acquire)) {
+    auto timeout  = std::chrono::milliseconds(
+        m_drain_timeout.load(std::memory_order_relaxed));
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    bool idle     = quiescent();
+    while (!idle && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(SHUTDOWN_POLL_INTERVAL);
+      idle = quiescent();
+    }
+    if (!idle) {
+      mode = SHUTDOWN::CANCEL;
+    }
+  }
+  shutdown(mode, std::chrono::milliseconds::zero());
+  delete m_thread_cxts[0];
+}
+
+bool scheduler::shutdown(SHUTDOWN mode, std::chrono::milliseconds timeout) {
+  if (is_worker_thread()) {
+    std::cerr << "shutdown() called from a worker\n";
+    return false;
+  }
+  if (m_shut_down.exchange(true, std::memory_order_acq_rel)) {
+    return true;
+  }
+  stop_stats_hook();
+  if (mode == SHUTDOWN::CANCEL) {
+    cancel_roots();
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  bool dry      = ran_dry();
+  while (!dry && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(SHUTDOWN_POLL_INTERVAL);
+    dry = ran_dry();
+  }
+
+  stop_workers();
+  reclaim_roots();
+  free_contexts();
+  return dry;
+}
+
+bool scheduler::ran_dry() noexcept {
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 0; i <= total_threads; ++i) {
+    thread_context *cxt = m_thread_cxts[i];
+    std::unique_lock lk(cxt->m_roots_mutex);
+    if (cxt->m_roots != nullptr) {
+      return false;
+    }
+  }
+  return quiescent();
+}
+
+bool scheduler::quiescent() const noexcept {
+  return !has_queued_tasks() &&
+         m_parked_count.load(std::memory_order_seq_cst) ==
+             m_active_threads.load(std::memory_order_seq_cst);
+}
+
+void scheduler::stop_workers() {
+  {
+    // No worker is spawned once this is set.
+    std::unique_lock lk(m_spawn_thread_mutex);
+    m_stop_requested = true;
+  }
+  unpark_all();
+  wake_all_io_sleepers();
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 1; i <= total_threads; ++i) {
+    if (m_thread_cxts[i]->m_thread.joinable()) {
+      m_thread_cxts[i]->m_thread.join();
+    }
+  }
+}
+
+void scheduler::free_contexts() {
+  // Tasks still queued belong to the roots, they are dropped with the deques.
+  auto total_threads = m_total_threads.exchange(0, std::memory_order_acq_rel);
+  for (unsigned int i = 1; i <= total_threads; ++i) {
+    thread_context *cxt = m_thread_cxts[i];
+    for (auto &tasks : cxt->m_tasks) {
+      delete tasks;
+    }
+    if (cxt->m_wake_fd >= 0) {
+      close(cxt->m_wake_fd);
+    }
+    delete cxt;
+    m_thread_cxts[i] = nullptr;
+  }
+}
+
+void scheduler::track(scheduler_root &root, std::coroutine_handle<> handle,
+                      std::stop_source &stop_source,
+                      std::atomic_bool &destroy_ctl) {
+  // The list of the calling worker, only contended when a root it spawned
+  // finishes on another thread at the same time.
+  thread_context *cxt = m_thread_cxts[is_worker_thread() ? m_thread_id : 0];
+  std::unique_lock lk(cxt->m_roots_mutex);
+  root.m_handle      = handle;
+  root.m_stop_source = &stop_source;
+  root.m_destroy_ctl = &destroy_ctl;
+  root.m_context     = cxt;
+  root.m_prev        = nullptr;
+  root.m_next        = cxt->m_roots;
+  if (cxt->m_roots != nullptr) {
+    cxt->m_roots->m_prev = &root;
+  }
+  cxt->m_roots = &root;
+  root.m_scheduler.store(this, std::memory_order_release);
+}
+
+void scheduler::untrack(scheduler_root *root) noexcept {
+  std::unique_lock lk(root->m_context->m_roots_mutex);
+  unlink(root);
+}
+
+void scheduler::unlink(scheduler_root *root) noexcept {
+  if (root->m_prev != nullptr) {
+    root->m_prev->m_next = root->m_next;
+  } else {
+    root->m_context->m_roots = root->m_next;
+  }
+  if (root->m_next != nullptr) {
+    root->m_next->m_prev = root->m_prev;
+  }
+  root->m_prev = nullptr;
+  root->m_next = nullptr;
+}
+
+void scheduler::cancel_roots() {
+  // Stop callbacks run user code, they must not run under the lock.
+  std::vector<std::stop_source> sources;
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 0; i <= total_threads; ++i) {
+    thread_context *cxt = m_thread_cxts[i];
+    std::unique_lock lk(cxt->m_roots_mutex);
+    for (auto *root = cxt->m_roots; root != nullptr; root = root->m_next) {
+      sources.push_back(*root->m_stop_source);
+    }
+  }
+  for (auto &source : sources) {
+    source.request_stop();
+  }
+}
+
+void scheduler::reclaim_roots() {
+  /* Claim the roots still registered, a root whose frame is being destroyed
+   * right now already cleared m_scheduler and unlinks itself.
+   */
+  std::vector<scheduler_root *> roots;
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 0; i <= total_threads; ++i) {
+    thread_context *cxt = m_thread_cxts[i];
+    std::unique_lock lk(cxt->m_roots_mutex);
+    scheduler_root *root = cxt->m_roots;
+    while (root != nullptr) {
+      scheduler_root *next = root->m_next;
+      if (root->m_scheduler.exchange(nullptr, std::memory_order_acq_rel)) {
+        unlink(root);
+        roots.push_back(root);
+      }
+      root = next;
+    }
+  }
+
+  /* Destroying a frame destroys the launch and async objects inside it,
+   * which hand the frames of their own roots over to us, so no root is freed
+   * before its turn comes.
+   */
+  for (scheduler_root *root : roots) {
+    std::coroutine_handle<> handle = root->m_handle;
+    if (root->m_destroy_ctl->exchange(true, std::memory_order_acq_rel)) {
+      handle.destroy();
+    }
   }
 }
 
 bool scheduler::steal_task(std::coroutine_handle<> &handle) noexcept {
-  auto total_threads = m_total_threads.load(std::memory_order_relaxed);
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  // Other threads own no deque to take a batch into, a single task only.
+  if (!is_worker_thread()) {
+    for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+      for (unsigned int i = 1; i <= total_threads; ++i) {
+        if (m_thread_cxts[i]->m_tasks[lane]->steal(handle)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+  if (m_victims_threads != total_threads) [[unlikely]] {
+    build_victims(total_threads);
+  }
 
-  bool c = false;
-  do {
-    c              = false;
-    unsigned int i = (m_thread_id + 1) % (total_threads + 1);
-    do {
-      task_queue *queue = m_thread_cxts[i]->m_tasks;
-      if (queue->steal(handle)) {
-        return true;
+  thread_context *cxt = m_thread_cxts[m_thread_id];
+
+  /* Higher lanes first, so that thieves take over urgent work. A batch goes
+   * into the own deque of the lane, where the next thief may take half of it
+   * again, and the newest of it runs first.
+   */
+  auto steal_range = [&](size_t first, size_t last, bool &pending) {
+    for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+      task_queue *tasks = cxt->m_tasks[lane];
+      for (size_t k = first; k < last; ++k) {
+        task_queue *queue = m_thread_cxts[m_victims[k]]->m_tasks[lane];
+        size_t moved      = queue->steal_batch(*tasks, STEAL_BATCH);
+        if (moved != 0) {
+          cxt->m_stats.m_stolen.add(moved);
+          if (tasks->dequeue(handle)) {
+            m_priority = static_cast<PRIORITY>(lane);
+            return true;
+          }
+        }
+        pending = pending | !queue->empty();
       }
-      c = c | !queue->empty();
-      i = (i + 1) % (total_threads + 1);
-    } while (i != m_thread_id);
-  } while (c);
+    }
+    return false;
+  };
+
+  bool pending        = false;
+  cxt->m_stats.m_steal_attempts.add();
+  do {
+    pending = false;
+    if (steal_range(0, m_local_victims, pending)) {
+      cxt->m_stats.m_local_steals.add();
+      return true;
+    }
+    // Stay on this node as long as it has work.
+    if (pending) {
+      continue;
+    }
+    if (steal_range(m_local_victims, m_victims.size(), pending)) {
+      cxt->m_stats.m_remote_steals.add();
+      return true;
+    }
+  } while (pending);
 
   return false;
 }
 
+void scheduler::build_victims(unsigned int total_threads) {
+  const cpu_info *self = m_thread_cxts[m_thread_id]->m_cpu;
+  auto proximity       = [&](unsigned int i) {
+    // Without a cpu a thread is near no worker, nor is it remote to any.
+    const cpu_info *cpu = m_thread_cxts[i]->m_cpu;
+    if (self == nullptr || cpu == nullptr) {
+      return CPU_DISTANCE::NODE;
+    }
+    return cpu_topology::distance(*self, *cpu);
+  };
+
+  // Workers only, start after this thread so that equally near victims are
+  // spread.
+  m_victims.clear();
+  for (unsigned int n = 1; n <= total_threads; ++n) {
+    unsigned int victim = (m_thread_id + n - 1) % total_threads + 1;
+    if (victim != m_thread_id) {
+      m_victims.push_back(victim);
+    }
+  }
+  std::stable_sort(m_victims.begin(), m_victims.end(),
+                   [&](unsigned int a, unsigned int b) {
+                     return proximity(a) < proximity(b);
+                   });
+  m_local_victims =
+      std::count_if(m_victims.begin(), m_victims.end(), [&](unsigned int i) {
+        return proximity(i) != CPU_DISTANCE::REMOTE;
+      });
+  m_victims_threads = total_threads;
+}
+
+void scheduler::pin_worker() noexcept {
+  const cpu_info *cpu = m_thread_cxts[m_thread_id]->m_cpu;
+  if (cpu != nullptr && !pin_thread(pthread_self(), {cpu->m_cpu})) {
+    std::cerr << "Pinning worker " << m_thread_id << " to cpu " << cpu->m_cpu
+              << " failed\n";
+  }
+}
+
+uint64_t scheduler::sum_counter(
+    stat_counter thread_counters::*counter) const noexcept {
+  uint64_t sum       = 0;
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 0; i <= total_threads; ++i) {
+    sum += (m_thread_cxts[i]->m_stats.*counter).load();
+  }
+  return sum;
+}
+
+uint64_t scheduler::local_steals() const noexcept {
+  return sum_counter(&thread_counters::m_local_steals);
+}
+
+uint64_t scheduler::remote_steals() const noexcept {
+  return sum_counter(&thread_counters::m_remote_steals);
+}
+
+uint64_t scheduler::stolen() const noexcept {
+  return sum_counter(&thread_counters::m_stolen);
+}
+
+uint64_t scheduler::long_slices() const noexcept {
+  return sum_counter(&thread_counters::m_long_slices);
+}
+
+uint64_t scheduler::budget_yields() const noexcept {
+  return sum_counter(&thread_counters::m_budget_yields);
+}
+
 void scheduler::schedule(const std::coroutine_handle<> &handle) noexcept {
-  if (!m_thread_id | (m_coro_scheduler_id != m_id)) {
-    std::unique_lock lk(m_global_task_queue_mutex);
-    m_thread_cxts[0]->m_tasks->enqueue(handle);
+  schedule(handle, current_priority());
+}
+
+void scheduler::schedule(const std::coroutine_handle<> &handle,
+                         PRIORITY priority) noexcept {
+  auto lane = static_cast<unsigned int>(priority);
+  if (is_worker_thread()) {
+    m_thread_cxts[m_thread_id]->m_tasks[lane]->enqueue(handle);
+  } else {
+    m_injection[lane].push(handle);
+  }
+  wake_workers(1);
+}
+
+void scheduler::schedule_bulk(
+    std::span<const std::coroutine_handle<>> handles) noexcept {
+  schedule_bulk(handles, current_priority());
+}
+
+void scheduler::schedule_bulk(std::span<const std::coroutine_handle<>> handles,
+                              PRIORITY priority) noexcept {
+  if (handles.empty()) {
+    return;
+  }
+  auto lane = static_cast<unsigned int>(priority);
+  if (is_worker_thread()) {
+    task_queue *tasks = m_thread_cxts[m_thread_id]->m_tasks[lane];
+    for (auto &handle : handles) {
+      tasks->enqueue(handle);
+    }
   } else {
-    m_thread_cxts[m_thread_id]->m_tasks->enqueue(handle);
+    m_injection[lane].push(handles.begin(), handles.end());
   }
-  if (!m_task_wait_flag.test_and_set(std::memory_order_relaxed))
-    m_task_wait_flag.notify_one();
+  wake_workers(handles.size());
+}
+
+PRIORITY scheduler::current_priority() const noexcept {
+  return is_worker_thread() ? m_priority : PRIORITY::NORMAL;
+}
+
+void scheduler::defer(const std::coroutine_handle<> &handle) noexcept {
+  if (!is_worker_thread()) {
+    schedule(handle);
+    return;
+  }
+  m_thread_cxts[m_thread_id]->m_yielded.emplace_back(handle, m_priority);
+}
+
+auto scheduler::transfer_to(const std::coroutine_handle<> &handle) noexcept
+    -> std::coroutine_handle<> {
+  if (!slice_expired()) [[likely]] {
+    return handle;
+  }
+  m_thread_cxts[m_thread_id]->m_stats.m_budget_yields.add();
+  defer(handle);
+  return get_next_coroutine();
+}
+
+void scheduler::set_time_budget(std::chrono::nanoseconds budget) noexcept {
+  m_time_budget.store(budget.count(), std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds scheduler::time_budget() const noexcept {
+  return std::chrono::nanoseconds(
+      m_time_budget.load(std::memory_order_relaxed));
+}
+
+bool scheduler::slice_expired() const noexcept {
+  auto budget = m_time_budget.load(std::memory_order_relaxed);
+  if (budget == 0 || !is_worker_thread() ||
+      m_slice_start == std::chrono::steady_clock::time_point{}) {
+    return false;
+  }
+  return std::chrono::steady_clock::now() - m_slice_start >
+         std::chrono::nanoseconds(budget);
+}
+
+void scheduler::wake_workers(size_t tasks) noexcept {
+  // Pairs with the fence in park(), either the parking worker sees the tasks
+  // or we see it parked.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_parked_count.load(std::memory_order_relaxed) != 0) {
+    // Spinners will pick up as many tasks as there are spinners.
+    size_t spinning = m_spinning.load(std::memory_order_relaxed);
+    for (size_t woken = spinning; woken < tasks && unpark_one(); ++woken) {
+    }
+  }
+  wake_io_sleeper();
 }
 
 bool scheduler::peek_next_coroutine(std::coroutine_handle<> &handle) noexcept {
-  return m_thread_cxts[m_thread_id]->m_tasks->dequeue(handle)
-             ? true
-             : steal_task(handle);
+  auto budget = m_time_budget.load(std::memory_order_relaxed);
+  if (budget == 0) [[likely]] {
+    return find_task(handle);
+  }
+
+  // The running task, if any, gives the worker up here.
+  auto now = std::chrono::steady_clock::now();
+  if (m_slice_start != std::chrono::steady_clock::time_point{}) {
+    if (now - m_slice_start > std::chrono::nanoseconds(budget)) {
+      m_thread_cxts[m_thread_id]->m_stats.m_long_slices.add();
+    }
+    m_slice_start = {};
+  }
+  if (!find_task(handle)) {
+    return false;
+  }
+  if (is_worker_thread()) {
+    m_slice_start = now;
+  }
+  return true;
+}
+
+bool scheduler::find_task(std::coroutine_handle<> &handle) noexcept {
+  // Keep reaping completions owned by this thread even when it never runs
+  // out of work, otherwise its io would wait for the queue to drain.
+  if ((++m_poll_tick & (POLL_INTERVAL - 1)) == 0) [[unlikely]] {
+    poll_pollables();
+  }
+  if ((m_poll_tick & (INJECTION_INTERVAL - 1)) == 0) [[unlikely]] {
+    drain_injection();
+    requeue_yielded();
+  }
+  if (dequeue_task(handle)) {
+    return true;
+  }
+  if (drain_injection() && dequeue_task(handle)) {
+    return true;
+  }
+  if (poll_pollables() && dequeue_task(handle)) {
+    return true;
+  }
+  if (requeue_yielded() && dequeue_task(handle)) {
+    return true;
+  }
+  return steal_task(handle);
+}
+
+bool scheduler::requeue_yielded() noexcept {
+  if (!is_worker_thread()) {
+    return false;
+  }
+  thread_context *cxt = m_thread_cxts[m_thread_id];
+  if (cxt->m_yielded.empty()) {
+    return false;
+  }
+  for (auto &[handle, priority] : cxt->m_yielded) {
+    cxt->m_tasks[static_cast<unsigned int>(priority)]->enqueue(handle);
+  }
+  cxt->m_yielded.clear();
+  return true;
+}
+
+bool scheduler::dequeue_task(std::coroutine_handle<> &handle) noexcept {
+  if (!is_worker_thread()) {
+    return false;
+  }
+  thread_context *cxt = m_thread_cxts[m_thread_id];
+  auto &tasks         = cxt->m_tasks;
+
+  // Lane that goes first on this pick, see STARVATION_INTERVAL.
+  unsigned int first = 0;
+  unsigned int tick  = m_poll_tick;
+  while (first + 1 < PRIORITY_LANES &&
+         (tick & (STARVATION_INTERVAL - 1)) == 0) {
+    tick /= STARVATION_INTERVAL;
+    ++first;
+  }
+
+  if (first != 0 && tasks[first]->dequeue(handle)) {
+    m_priority = static_cast<PRIORITY>(first);
+    cxt->m_stats.m_dequeues.add();
+    return true;
+  }
+  for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+    if (tasks[lane]->dequeue(handle)) {
+      m_priority = static_cast<PRIORITY>(lane);
+      cxt->m_stats.m_dequeues.add();
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t scheduler::drain_injection() noexcept {
+  // Only the owner may push into a deque.
+  if (!is_worker_thread()) {
+    return 0;
+  }
+  thread_context *cxt = m_thread_cxts[m_thread_id];
+  size_t count        = 0;
+  for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+    count += m_injection[lane].pop_all([&](std::coroutine_handle<> &handle) {
+      cxt->m_tasks[lane]->enqueue(handle);
+    });
+  }
+  if (count != 0) {
+    cxt->m_stats.m_injected.add(count);
+  }
+  return count;
+}
+
+unsigned int scheduler::poll_pollables() noexcept {
+  if (!is_worker_thread()) [[unlikely]] {
+    return 0;
+  }
+  std::shared_lock lk(m_pollables_mutex);
+  unsigned int completed = 0;
+  for (auto &source : m_pollables) {
+    completed += source->poll();
+  }
+  return completed;
+}
+
+bool scheduler::pollables_pending() noexcept {
+  std::shared_lock lk(m_pollables_mutex);
+  for (auto &source : m_pollables) {
+    if (source->pending()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void scheduler::wait_pollables() noexcept {
+  thread_context *cxt = m_thread_cxts[m_thread_id];
+
+  // Publish that this thread sleeps before checking the queues again, a
+  // schedule() racing with us either sees the flag or its task is found.
+  cxt->m_io_sleeping.store(true, std::memory_order_seq_cst);
+  m_total_io_sleeping_threads.fetch_add(1, std::memory_order_seq_cst);
+
+  bool slept = false;
+  if (!has_queued_tasks() && !m_stop_requested) {
+    std::shared_lock lk(m_pollables_mutex);
+    for (auto &source : m_pollables) {
+      if (source->pending() &&
+          source->wait(cxt->m_wake_fd, POLL_WAIT_TIMEOUT)) {
+        slept = true;
+        break;
+      }
+    }
+  }
+
+  cxt->m_io_sleeping.store(false, std::memory_order_relaxed);
+  m_total_io_sleeping_threads.fetch_sub(1, std::memory_order_relaxed);
+  if (!slept) {
+    std::this_thread::yield();
+  }
+}
+
+void scheduler::wake_io_sleeper() noexcept {
+  if (m_total_io_sleeping_threads.load(std::memory_order_seq_cst) == 0) {
+    return;
+  }
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 1; i <= total_threads; ++i) {
+    thread_context *cxt = m_thread_cxts[i];
+    if (cxt->m_io_sleeping.exchange(false, std::memory_order_acq_rel)) {
+      eventfd_write(cxt->m_wake_fd, 1);
+      return;
+    }
+  }
+}
+
+void scheduler::wake_all_io_sleepers() noexcept {
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 1; i <= total_threads; ++i) {
+    thread_context *cxt = m_thread_cxts[i];
+    if (cxt->m_io_sleeping.exchange(false, std::memory_order_acq_rel)) {
+      eventfd_write(cxt->m_wake_fd, 1);
+    }
+  }
+}
+
+bool scheduler::has_local_tasks() const noexcept {
+  for (auto &tasks : m_thread_cxts[m_thread_id]->m_tasks) {
+    if (!tasks->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool scheduler::has_queued_tasks() const noexcept {
+  for (auto &injection : m_injection) {
+    if (!injection.empty()) {
+      return true;
+    }
+  }
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  for (unsigned int i = 1; i <= total_threads; ++i) {
+    for (auto &tasks : m_thread_cxts[i]->m_tasks) {
+      if (!tasks->empty()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+bool scheduler::spin_for_task(std::coroutine_handle<> &handle) noexcept {
+  // Keep at most half of the awake workers spinning.
+  unsigned int awake = m_active_threads.load(std::memory_order_relaxed) -
+                       m_parked_count.load(std::memory_order_relaxed);
+  if (2 * m_spinning.load(std::memory_order_relaxed) >= awake) {
+    return false;
+  }
+
+  m_spinning.fetch_add(1, std::memory_order_seq_cst);
+  for (unsigned int round = 0; round < SPIN_ROUNDS; ++round) {
+    if (peek_next_coroutine(handle)) {
+      // The last spinner leaving hands the search over to a parked worker
+      // in case more tasks are queued.
+      if (m_spinning.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+          has_queued_tasks()) {
+        unpark_one();
+      }
+      return true;
+    }
+    if (m_stop_requested) [[unlikely]] {
+      break;
+    }
+    cpu_relax();
+  }
+  m_spinning.fetch_sub(1, std::memory_order_seq_cst);
+  return false;
+}
+
+static void futex_wait(std::atomic_uint32_t &word, uint32_t expected,
+                       const timespec *timeout) noexcept {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE,
+          expected, timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic_uint32_t &word) noexcept {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, 1,
+          nullptr, nullptr, 0);
+}
+
+bool scheduler::park() noexcept {
+  thread_context *cxt = m_thread_cxts[m_thread_id];
+  {
+    std::unique_lock lk(m_park_mutex);
+    cxt->m_parked.store(1, std::memory_order_relaxed);
+    m_parked.push_back(m_thread_id);
+    m_parked_count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Take ourselves off the list unless a waker already did.
+  auto unlist = [&] {
+    std::unique_lock lk(m_park_mutex);
+    auto it = std::find(m_parked.begin(), m_parked.end(), m_thread_id);
+    if (it == m_parked.end()) {
+      return false;
+    }
+    m_parked.erase(it);
+    m_parked_count.fetch_sub(1, std::memory_order_relaxed);
+    cxt->m_parked.store(0, std::memory_order_relaxed);
+    return true;
+  };
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (has_queued_tasks() || m_stop_requested) {
+    // A task raced with us.
+    unlist();
+    return true;
+  }
+
+  cxt->m_stats.m_parks.add();
+  auto parked_at  = std::chrono::steady_clock::now();
+  auto count_idle = [&] {
+    cxt->m_stats.m_idle_ns.add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - parked_at)
+            .count());
+  };
+
+  // Only workers that may retire need to wake up on their own.
+  bool timed = m_active_threads.load(std::memory_order_relaxed) -
+                   m_blocked_threads.load(std::memory_order_relaxed) >
+               m_min_threads.load(std::memory_order_relaxed);
+  auto deadline =
+      parked_at +
+      std::chrono::milliseconds(m_idle_timeout.load(std::memory_order_relaxed));
+
+  while (cxt->m_parked.load(std::memory_order_acquire) == 1) {
+    if (!timed) {
+      futex_wait(cxt->m_parked, 1, nullptr);
+      continue;
+    }
+    auto left = deadline - std::chrono::steady_clock::now();
+    if (left <= std::chrono::steady_clock::duration::zero() && unlist()) {
+      count_idle();
+      return false;
+    }
+    auto sec  = std::chrono::duration_cast<std::chrono::seconds>(left);
+    auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(left) -
+                std::chrono::duration_cast<std::chrono::nanoseconds>(sec);
+    timespec ts{std::max<time_t>(sec.count(), 0),
+                std::max<long>(nsec.count(), 0)};
+    futex_wait(cxt->m_parked, 1, &ts);
+  }
+  count_idle();
+  cxt->m_stats.m_wakeups.add();
+  return true;
+}
+
+bool scheduler::retire() noexcept {
+  // Never below the minimum of workers able to run tasks.
+  auto active = m_active_threads.load(std::memory_order_relaxed);
+  do {
+    if (active - m_blocked_threads.load(std::memory_order_relaxed) <=
+        m_min_threads.load(std::memory_order_relaxed)) {
+      return false;
+    }
+  } while (!m_active_threads.compare_exchange_weak(active, active - 1,
+                                                   std::memory_order_relaxed));
+  m_thread_cxts[m_thread_id]->m_retired.store(true, std::memory_order_release);
+  return true;
+}
+
+bool scheduler::unpark_one() noexcept {
+  thread_context *cxt;
+  {
+    std::unique_lock lk(m_park_mutex);
+    if (m_parked.empty()) {
+      return false;
+    }
+    // Most recently parked first, its cache is the least cold.
+    cxt = m_thread_cxts[m_parked.back()];
+    m_parked.pop_back();
+    m_parked_count.fetch_sub(1, std::memory_order_relaxed);
+    cxt->m_parked.store(0, std::memory_order_release);
+  }
+  futex_wake(cxt->m_parked);
+  return true;
+}
+
+void scheduler::unpark_all() noexcept {
+  while (unpark_one()) {
+  }
+}
+
+void scheduler::attach(pollable *source) {
+  std::unique_lock lk(m_pollables_mutex);
+  m_pollables.push_back(source);
+}
+
+void scheduler::detach(pollable *source) {
+  // Workers sleeping inside a pollable hold the lock, get them out first.
+  wake_all_io_sleepers();
+  std::unique_lock lk(m_pollables_mutex);
+  m_pollables.erase(std::remove(m_pollables.begin(), m_pollables.end(), source),
+                    m_pollables.end());
+}
+
+bool scheduler::is_worker_thread() const noexcept {
+  return m_thread_id != 0 && m_coro_scheduler_id == m_id;
 }
 
 std::coroutine_handle<> scheduler::get_waiting_channel() noexcept {
@@ -69,6 +876,11 @@ std::coroutine_handle<> scheduler::get_waiting_channel() noexcept {
 }
 
 auto scheduler::get_next_coroutine() noexcept -> std::coroutine_handle<> {
+  // Once stopping, go back to the worker loop at the next suspension point,
+  // a worker never running out of tasks would not be joinable otherwise.
+  if (m_stop_requested && is_worker_thread()) [[unlikely]] {
+    return get_waiting_channel();
+  }
   std::coroutine_handle<> handle;
   return peek_next_coroutine(handle) ? handle : get_waiting_channel();
 }
@@ -90,83 +902,123 @@ scheduler_task scheduler::awaiter() {
     std::coroutine_handle<> handle;
 
     while (!peek_next_coroutine(handle)) {
-      std::unique_lock<std::mutex> lk(m_task_mutex);
-      m_task_wait_flag.wait(false, std::memory_order_relaxed);
-      lk.unlock();
+      // Completions of this thread are only reaped by this thread, so it
+      // can not park while it still has io in flight.
+      if (pollables_pending()) {
+        if (m_stop_requested) [[unlikely]] {
+          co_return;
+        }
+        wait_pollables();
+        continue;
+      }
+      if (spin_for_task(handle)) {
+        break;
+      }
+      // Idle past the timeout, leave if the pool is above its minimum.
+      if (!park() && retire()) {
+        co_return;
+      }
       if (m_stop_requested) [[unlikely]] {
         co_return;
       }
-      m_task_wait_flag.clear(std::memory_order_relaxed);
     }
 
     co_await thread_awaiter{handle};
   }
 }
 
-void scheduler::spawn_workers(const unsigned int &count) {
+unsigned int scheduler::spawn_workers(const unsigned int &count) {
+  unsigned int spawned = 0;
+  while (spawned < count && spawn_worker()) {
+    m_min_threads.fetch_add(1, std::memory_order_relaxed);
+    ++spawned;
+  }
+  return spawned;
+}
+
+bool scheduler::spawn_worker() {
   std::unique_lock<std::mutex> lk(m_spawn_thread_mutex);
-  for (unsigned int i = 0; i < count; ++i) {
-    init_thread();
-    m_thread_cxts[m_total_threads]->m_thread = std::thread(
-        [&](unsigned int id) {
-          m_thread_id         = id;
-          m_coro_scheduler_id = m_id;
-          m_thread_cxts[id]->m_waiting_channel.resume();
-        },
-        ++m_total_threads);
+  if (m_stop_requested ||
+      m_active_threads.load(std::memory_order_relaxed) >= m_max_threads) {
+    return false;
   }
+
+  // Reuse the slot of a retired worker before taking a new one.
+  auto total_threads = m_total_threads.load(std::memory_order_relaxed);
+  unsigned int id    = 1;
+  while (id <= total_threads &&
+         !m_thread_cxts[id]->m_retired.load(std::memory_order_acquire)) {
+    ++id;
+  }
+
+  thread_context *cxt;
+  if (id <= total_threads) {
+    cxt = m_thread_cxts[id];
+    cxt->m_thread.join();
+    cxt->m_retired.store(false, std::memory_order_relaxed);
+  } else {
+    cxt = new thread_context;
+    for (auto &tasks : cxt->m_tasks) {
+      tasks = new task_queue(64);
+    }
+    cxt->m_wake_fd = eventfd(0, EFD_CLOEXEC);
+    // Worker n takes placement slot n - 1, wrapping past the last cpu.
+    if (!m_placement.empty()) {
+      cxt->m_cpu = &m_placement[(id - 1) % m_placement.size()];
+    }
+    m_thread_cxts[id] = cxt;
+    m_total_threads.store(id, std::memory_order_release);
+  }
+  cxt->m_waiting_channel = awaiter().handle();
+  m_active_threads.fetch_add(1, std::memory_order_relaxed);
+
+  cxt->m_thread = std::thread(
+      [this](unsigned int id) {
+        m_thread_id         = id;
+        m_coro_scheduler_id = m_id;
+        name_thread(pthread_self(), m_thread_name + "-" + std::to_string(id));
+        pin_worker();
+        m_thread_cxts[id]->m_waiting_channel.resume();
+      },
+      id);
+  return true;
 }
 
-void scheduler::init_thread() {
-  thread_context *cxt           = new thread_context;
-  cxt->m_thread_status.m_status = thread_status::STATUS::READY;
-  cxt->m_tasks                  = new task_queue(64);
-  cxt->m_waiting_channel        = awaiter().handle();
-  m_thread_cxts.push_back(cxt);
+void scheduler::set_idle_timeout(std::chrono::milliseconds timeout) noexcept {
+  m_idle_timeout.store(timeout.count(), std::memory_order_relaxed);
 }
 
-void scheduler::set_thread_status(thread_status::STATUS status) noexcept {
+void scheduler::set_drain_timeout(std::chrono::milliseconds timeout) noexcept {
+  m_drain_timeout.store(timeout.count(), std::memory_order_relaxed);
+}
 
-  switch (status) {
-  case thread_status::STATUS::READY:
-    set_thread_ready();
-    break;
-  case thread_status::STATUS::RUNNING:
-    set_thread_running();
-    break;
-  case thread_status::STATUS::SUSPENDED:
-    set_thread_suspended();
-    break;
-  default:
-    break;
+void scheduler::begin_blocking() noexcept {
+  if (!is_worker_thread()) {
+    return;
+  }
+  // Let the other workers take over what is queued here.
+  if (requeue_yielded() | has_local_tasks()) {
+    wake_workers(1);
+  }
+  auto blocked = m_blocked_threads.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (m_active_threads.load(std::memory_order_relaxed) - blocked <
+      m_min_threads.load(std::memory_order_relaxed)) {
+    spawn_worker();
   }
 }
 
-void scheduler::set_thread_suspended() noexcept {
-  this->m_total_running_threads.fetch_sub(1, std::memory_order_relaxed);
-  if ((this->m_total_suspended_threads.fetch_add(1, std::memory_order_relaxed) +
-       1) >= m_total_threads.load(std::memory_order_relaxed)) {
-    spawn_workers(1);
+void scheduler::end_blocking() noexcept {
+  if (!is_worker_thread()) {
+    return;
   }
-  m_thread_cxts[m_thread_id]->m_thread_status.m_status.store(
-      thread_status::STATUS::SUSPENDED, std::memory_order_relaxed);
+  // Workers spawned in our place retire once idle.
+  m_blocked_threads.fetch_sub(1, std::memory_order_relaxed);
 }
 
-void scheduler::set_thread_ready() noexcept {
-  this->m_total_running_threads.fetch_sub(1, std::memory_order_relaxed);
-  this->m_total_ready_threads.fetch_add(1, std::memory_order_relaxed);
-  m_thread_cxts[m_thread_id]->m_thread_status.m_status.store(
-      thread_status::STATUS::READY, std::memory_order_relaxed);
+unsigned int scheduler::threads() const noexcept {
+  return m_active_threads.load(std::memory_order_relaxed);
 }
 
-void scheduler::set_thread_running() noexcept {
-  if (m_thread_cxts[m_thread_id]->m_thread_status.m_status.load(
-          std::memory_order_relaxed) == thread_status::STATUS::SUSPENDED) {
-    this->m_total_suspended_threads.fetch_sub(1, std::memory_order_relaxed);
-  } else {
-    this->m_total_ready_threads.fetch_sub(1, std::memory_order_relaxed);
-  }
-  this->m_total_running_threads.fetch_add(1, std::memory_order_relaxed);
-  m_thread_cxts[m_thread_id]->m_thread_status.m_status.store(
-      thread_status::STATUS::RUNNING, std::memory_order_relaxed);
+unsigned int scheduler::blocked_threads() const noexcept {
+  return m_blocked_threads.load(std::memory_order_relaxed);
 }
@@ -1,21 +1,37 @@
 #ifndef __CORO_SCHEDULER_CORO_SCHEDULER_HPP__
 #define __CORO_SCHEDULER_CORO_SCHEDULER_HPP__
 
+#include "pollable.hpp"
+#include "queue/cache_line.hpp"
+#include "queue/injection_queue.hpp"
 #include "queue/work_stealing_queue.hpp"
+#include "topology.hpp"
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <coroutine>
 #include <functional>
+#include <iosfwd>
 #include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <stop_token>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 using task_queue = work_stealing_queue<std::coroutine_handle<>>;
 
-struct thread_status {
-  enum class STATUS { NEW, READY, RUNNING, SUSPENDED };
-  std::atomic<STATUS> m_status;
-};
+/* Priority lane of a task. A coroutine keeps the lane it was last scheduled
+ * on: schedule() without a priority uses the lane of the task running on the
+ * calling worker, and io resumes on the lane the op was issued from.
+ */
+enum class PRIORITY : unsigned int { HIGH, NORMAL, LOW };
+
+constexpr unsigned int PRIORITY_LANES = 3;
 
 struct scheduler_task {
   std::coroutine_handle<> m_handle;
@@ -40,56 +56,496 @@ struct scheduler_task {
   std::coroutine_handle<> handle() { return m_handle; }
 };
 
-struct thread_context {
+/* A counter only its owner thread adds to, with a plain load and store rather
+ * than a locked instruction, that any thread may read. Context 0 is shared by
+ * every foreign thread, its counters may miss a few of their updates.
+ */
+class stat_counter {
+  std::atomic_uint64_t m_value{0};
+
+public:
+  void add(uint64_t n = 1) noexcept {
+    m_value.store(m_value.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  }
+
+  uint64_t load() const noexcept {
+    return m_value.load(std::memory_order_relaxed);
+  }
+};
+
+/* Counters of a thread on cache lines of their own, reading them does not
+ * disturb the deques of the worker.
+ */
+struct alignas(CACHE_LINE_SIZE) thread_counters {
+  // Tasks taken from the own deques, steals from the nearest node or another.
+  stat_counter m_dequeues;
+  stat_counter m_local_steals;
+  stat_counter m_remote_steals;
+
+  // Searches through the deques of the other workers.
+  stat_counter m_steal_attempts;
+
+  // Tasks moved into the own deques by those steals, a steal takes a batch.
+  stat_counter m_stolen;
+
+  // Tasks moved from the injection queues into the own deques.
+  stat_counter m_injected;
+
+  // Parks, the ones ended by another thread and the time spent in parks
+  // that are over.
+  stat_counter m_parks;
+  stat_counter m_wakeups;
+  stat_counter m_idle_ns;
+
+  // Resumes that ran past the time budget, and tasks yielded because of it.
+  stat_counter m_long_slices;
+  stat_counter m_budget_yields;
+};
+
+// Snapshot of a thread_context, see scheduler::stats().
+struct thread_stats {
+  unsigned int id = 0;
+  int cpu         = -1;
+  bool retired    = false;
+  bool parked     = false;
+
+  // Tasks queued on each lane, always 0 for context 0.
+  std::array<size_t, PRIORITY_LANES> queued{};
+
+  // Tasks dequeued or stolen, stolen ones counted in the steals as well.
+  uint64_t tasks          = 0;
+  uint64_t steal_attempts = 0;
+  uint64_t local_steals   = 0;
+  uint64_t remote_steals  = 0;
+  uint64_t stolen         = 0;
+  uint64_t injected       = 0;
+  uint64_t parks          = 0;
+  uint64_t wakeups        = 0;
+  std::chrono::nanoseconds idle{0};
+  uint64_t long_slices   = 0;
+  uint64_t budget_yields = 0;
+};
+
+/* Snapshot of a scheduler. The values are read one by one while the workers
+ * run, so they are consistent with each other only once the scheduler is
+ * idle.
+ */
+struct scheduler_stats {
+  std::chrono::steady_clock::time_point time;
+
+  unsigned int threads             = 0;
+  unsigned int min_threads         = 0;
+  unsigned int max_threads         = 0;
+  unsigned int blocked_threads     = 0;
+  unsigned int parked_threads      = 0;
+  unsigned int spinning_threads    = 0;
+  unsigned int io_sleeping_threads = 0;
+
+  // Lanes with tasks in the injection queue.
+  std::array<bool, PRIORITY_LANES> injection_pending{};
+
+  // Context 0, the foreign threads, then every worker slot including
+  // retired ones.
+  std::vector<thread_stats> contexts;
+
+  // Sum of the contexts.
+  thread_stats total() const noexcept;
+};
+
+// One line for the scheduler, one per context and one for the total.
+std::ostream &operator<<(std::ostream &os, const scheduler_stats &stats);
+
+class scheduler_root;
+
+/* Contexts are allocated one after the other, each group below starts a
+ * cache line so that neither the owner nor the threads waking it or stealing
+ * from it write a line another one only reads.
+ */
+struct alignas(CACHE_LINE_SIZE) thread_context {
+  // Set up once, read by thieves on every steal.
   std::thread m_thread;
-  thread_status m_thread_status;
-  std::coroutine_handle<> m_waiting_channel;
-  task_queue *m_tasks;
+
+  // One deque per priority lane.
+  std::array<task_queue *, PRIORITY_LANES> m_tasks{};
+
+  // eventfd used to wake the worker while it sleeps inside a pollable.
+  int m_wake_fd = -1;
+
+  // Cpu the worker is pinned to, none for context 0 (foreign threads) and
+  // with PLACEMENT::NONE.
+  const cpu_info *m_cpu = nullptr;
+
+  // Set by a worker leaving the pool, its slot may then be reused.
+  alignas(CACHE_LINE_SIZE) std::atomic_bool m_retired{false};
+  std::atomic_bool m_io_sleeping{false};
+
+  // Futex word the worker parks on, 1 while parked.
+  std::atomic_uint32_t m_parked{0};
+
+  // Owner only.
+  alignas(CACHE_LINE_SIZE) std::coroutine_handle<> m_waiting_channel;
+
+  // Tasks that yielded, with their lane, requeued once the worker has
+  // nothing else to do.
+  std::vector<std::pair<std::coroutine_handle<>, PRIORITY>> m_yielded;
+
+  thread_counters m_stats;
+
+  /* Roots registered from this context, foreign threads share the list of
+   * context 0. Taken by the owner on every spawn and by whichever thread
+   * finishes one of them, each list has its own lock.
+   */
+  alignas(CACHE_LINE_SIZE) std::mutex m_roots_mutex;
+  scheduler_root *m_roots = nullptr;
+};
+
+/* How shutdown() treats the coroutines still running.
+ *
+ * DRAIN  : Let them finish, the queues run dry and every root returns.
+ * CANCEL : Request stop on the stop_source of every root first, then wait
+ *          for them like DRAIN.
+ *
+ * Either way the workers are stopped at the deadline and the frames of the
+ * roots left over are destroyed.
+ */
+enum class SHUTDOWN { DRAIN, CANCEL };
+
+class scheduler;
+
+/* A coroutine started with schedule_on, registered with its scheduler until
+ * it finishes or its frame is destroyed so that shutdown() can cancel it and
+ * free what is left of it. The frame is freed through m_destroy_ctl, a root
+ * still held by its launch or async object is left to that object.
+ */
+class scheduler_root {
+  friend class scheduler;
+
+  // Scheduler the root is registered with, null once it is not.
+  std::atomic<scheduler *> m_scheduler{nullptr};
+  std::coroutine_handle<> m_handle;
+  std::stop_source *m_stop_source = nullptr;
+  std::atomic_bool *m_destroy_ctl = nullptr;
+  thread_context *m_context       = nullptr;
+  scheduler_root *m_prev          = nullptr;
+  scheduler_root *m_next          = nullptr;
+
+public:
+  scheduler_root() = default;
+
+  scheduler_root(const scheduler_root &) = delete;
+  scheduler_root &operator=(const scheduler_root &) = delete;
+
+  ~scheduler_root() { release(); }
+
+  // Unregister, called once the coroutine reaches its final suspend.
+  void release() noexcept;
 };
 
 class scheduler {
+  friend class scheduler_root;
+
+  // Number of local dequeues between two polls of the attached pollables
+  // while a worker is busy (must be a power of 2).
+  static constexpr unsigned int POLL_INTERVAL = 64;
+
+  // Number of local dequeues between two drains of the injection queue while
+  // a worker is busy, so that injected tasks are not starved by local ones
+  // (must be a power of 2).
+  static constexpr unsigned int INJECTION_INTERVAL = 32;
+
+  // Upper bound for a worker sleeping inside a pollable, only matters when
+  // several pollables have io in flight on the same thread.
+  static constexpr std::chrono::milliseconds POLL_WAIT_TIMEOUT{10};
+
+  /* Starvation protection of the lower lanes: every STARVATION_INTERVAL-th
+   * pick of a worker starts at the normal lane, and every
+   * STARVATION_INTERVAL-th of those at the low lane (must be a power of 2).
+   */
+  static constexpr unsigned int STARVATION_INTERVAL = 8;
+
+  // Rounds an idle worker keeps looking for work before it parks.
+  static constexpr unsigned int SPIN_ROUNDS = 64;
+
+  // Most tasks a steal moves, on top of it a steal takes at most half of the
+  // deque of the victim.
+  static constexpr size_t STEAL_BATCH = 32;
+
+  // Default time a worker above the minimum stays parked before retiring.
+  static constexpr std::chrono::milliseconds IDLE_TIMEOUT{10000};
+  // How long the destructor waits for the workers to go idle.
+  static constexpr std::chrono::milliseconds DRAIN_TIMEOUT{5000};
+
+  // How often shutdown() checks whether the scheduler ran dry.
+  static constexpr std::chrono::milliseconds SHUTDOWN_POLL_INTERVAL{1};
+
   static thread_local unsigned int m_thread_id;
   static thread_local unsigned int m_coro_scheduler_id;
+  static thread_local unsigned int m_poll_tick;
+
+  // Lane of the task the worker is running.
+  static thread_local PRIORITY m_priority;
+
+  // When the running task got the worker, only kept with a time budget set.
+  static thread_local std::chrono::steady_clock::time_point m_slice_start;
+
+  /* Contexts the calling worker steals from, nearest first. The first
+   * m_local_victims are on the same node. Rebuilt when the thread count
+   * changes.
+   */
+  static thread_local std::vector<unsigned int> m_victims;
+  static thread_local unsigned int m_local_victims;
+  static thread_local unsigned int m_victims_threads;
   static unsigned int m_coro_scheduler_count;
   unsigned int m_id = 0;
 
+  /* Worker slots in use are 1 to m_total_threads, a slot keeps its context
+   * once its worker retired so that it can always be indexed.
+   * m_active_threads counts the live workers, m_blocked_threads the ones
+   * inside a blocking section.
+   */
   std::atomic_uint m_total_threads{0};
-  std::atomic_uint m_total_suspended_threads{0};
-  std::atomic_uint m_total_ready_threads{0};
-  std::atomic_uint m_total_running_threads{0};
+  std::atomic_uint m_active_threads{0};
+  std::atomic_uint m_blocked_threads{0};
+  std::atomic_uint m_total_io_sleeping_threads{0};
 
-  std::vector<thread_context *> m_thread_cxts;
+  /* Live workers not blocked are kept at m_min_threads or more, live
+   * workers never exceed m_max_threads.
+   */
+  std::atomic_uint m_min_threads{0};
+  unsigned int m_max_threads = 0;
+  std::atomic<std::chrono::milliseconds::rep> m_idle_timeout{
+      IDLE_TIMEOUT.count()};
+  std::atomic<std::chrono::milliseconds::rep> m_drain_timeout{
+      DRAIN_TIMEOUT.count()};
 
-  std::mutex m_task_mutex;
+  // Sized for m_max_threads once, it never reallocates under the workers.
+  std::vector<thread_context *> m_thread_cxts;
 
   std::mutex m_spawn_thread_mutex;
-  std::mutex m_global_task_queue_mutex;
-  std::atomic_flag m_task_wait_flag = ATOMIC_FLAG_INIT;
+
+  /* Tasks scheduled from threads that are not workers of this scheduler, io
+   * completions reaped by a cq thread among them. A worker moves the whole
+   * queue into its own deque where the other workers can steal from it.
+   */
+  std::array<injection_queue<std::coroutine_handle<>>, PRIORITY_LANES>
+      m_injection;
+
+  /* Idle workers first spin looking for work, then park on their own futex
+   * word. schedule() wakes a single parked worker, and only when nobody is
+   * spinning since a spinner will find the task anyway.
+   */
+  alignas(CACHE_LINE_SIZE) std::atomic_uint m_spinning{0};
+  std::atomic_uint m_parked_count{0};
+  std::vector<unsigned int> m_parked;
+  std::mutex m_park_mutex;
+
+  alignas(CACHE_LINE_SIZE) std::vector<pollable *> m_pollables;
+  std::shared_mutex m_pollables_mutex;
+
+  cpu_topology m_topology;
+
+  // Cpus of the worker slots in order, empty with PLACEMENT::NONE.
+  std::vector<cpu_info> m_placement;
+  std::string m_thread_name;
+
+  // Time a task may run before it is yielded at its next co_await, 0 when
+  // resumes are not timed.
+  std::atomic<std::chrono::nanoseconds::rep> m_time_budget{0};
+
+  // Thread running the hook of set_stats_hook().
+  std::thread m_stats_thread;
+  std::mutex m_stats_mutex;
+  std::condition_variable m_stats_cv;
+  bool m_stats_stop = false;
 
   bool m_stop_requested = false;
+  std::atomic_bool m_shut_down{false};
 
 public:
+  // One worker per cpu, growing to twice that for blocking sections.
   scheduler();
-  scheduler(unsigned int threa);
+
+  // threads workers, growing to twice that for blocking sections.
+  scheduler(unsigned int threads);
+
+  /* Keep min_threads workers able to run tasks, spawning more while workers
+   * are blocked, up to max_threads. Workers above min_threads retire after
+   * the idle timeout.
+   */
+  scheduler(unsigned int min_threads, unsigned int max_threads,
+            const placement_config &placement = {});
+
+  // One worker per cpu of the placement, growing to twice that.
+  explicit scheduler(const placement_config &placement);
+
+  /* Run what is queued and wait up to the drain timeout for the workers to
+   * go idle, then shutdown(SHUTDOWN::DRAIN, 0), or SHUTDOWN::CANCEL if they
+   * did not. Roots still suspended at that point wait on something outside
+   * the scheduler and their frames are destroyed, so an io_service they wait
+   * on must be torn down first, as it is when declared after the scheduler.
+   * Destroying the scheduler from one of its workers aborts.
+   */
   ~scheduler();
 
+  /* Wait up to timeout for the roots to finish and the queues to run dry,
+   * then stop the workers, destroy the frames of the roots left over and
+   * free the contexts of the workers. Returns false if the scheduler did not
+   * run dry in time. Not to be called from a worker.
+   */
+  bool shutdown(SHUTDOWN mode, std::chrono::milliseconds timeout);
+
+  /* Register the coroutine of promise as a root, the promise has m_root,
+   * m_stop_source and m_destroy_ctl.
+   */
+  template <typename Promise>
+  void track(Promise &promise) {
+    track(promise.m_root, std::coroutine_handle<Promise>::from_promise(promise),
+          promise.m_stop_source, promise.m_destroy_ctl);
+  }
+
+  void track(scheduler_root &root, std::coroutine_handle<> handle,
+             std::stop_source &stop_source, std::atomic_bool &destroy_ctl);
+
+  // Schedule on the lane of the calling task.
   void schedule(const std::coroutine_handle<> &handle) noexcept;
 
+  void schedule(const std::coroutine_handle<> &handle,
+                PRIORITY priority) noexcept;
+
+  /* Schedule several handles at once, they are published together and at
+   * most one idle worker per handle is woken up.
+   */
+  void schedule_bulk(std::span<const std::coroutine_handle<>> handles) noexcept;
+
+  void schedule_bulk(std::span<const std::coroutine_handle<>> handles,
+                     PRIORITY priority) noexcept;
+
+  // Lane of the task running on the calling thread, NORMAL outside workers.
+  PRIORITY current_priority() const noexcept;
+
+  // Queue handle behind every other task of the calling worker.
+  void defer(const std::coroutine_handle<> &handle) noexcept;
+
+  /* Symmetric transfer to handle, unless the running task has used up its
+   * time budget. The handle is then deferred and the worker moves on.
+   */
+  auto transfer_to(const std::coroutine_handle<> &handle) noexcept
+      -> std::coroutine_handle<>;
+
+  /* Time every resume and yield tasks running longer than budget at their
+   * next co_await, 0 turns timing off.
+   */
+  void set_time_budget(std::chrono::nanoseconds budget) noexcept;
+
+  std::chrono::nanoseconds time_budget() const noexcept;
+
   auto get_next_coroutine() noexcept -> std::coroutine_handle<>;
 
-  void spawn_workers(const unsigned int &count);
+  // Add count permanent workers within max_threads, returns the number added.
+  unsigned int spawn_workers(const unsigned int &count);
+
+  void set_idle_timeout(std::chrono::milliseconds timeout) noexcept;
+
+  // Bound of the wait for idle workers in the destructor, DRAIN_TIMEOUT.
+  void set_drain_timeout(std::chrono::milliseconds timeout) noexcept;
+
+  /* Bracket a section that blocks the calling worker in a syscall, a worker
+   * is spawned in its place when too few are left to run tasks. Prefer
+   * co_await blocking(...).
+   */
+  void begin_blocking() noexcept;
+  void end_blocking() noexcept;
+
+  // Live workers, and those of them inside a blocking section.
+  unsigned int threads() const noexcept;
+  unsigned int blocked_threads() const noexcept;
+
+  // Register a completion source to be polled by the worker threads.
+  void attach(pollable *source);
+
+  // Remove a completion source. Once this returns no worker is polling it.
+  void detach(pollable *source);
+
+  // Check the calling thread is a worker of this scheduler.
+  bool is_worker_thread() const noexcept;
+
+  // Steals from a worker on the same NUMA node.
+  uint64_t local_steals() const noexcept;
+
+  // Steals that had to cross to another NUMA node.
+  uint64_t remote_steals() const noexcept;
+
+  // Tasks moved by the steals, several per steal when the victim has a
+  // backlog.
+  uint64_t stolen() const noexcept;
+
+  // Resumes that ran longer than the time budget.
+  uint64_t long_slices() const noexcept;
+
+  // Tasks yielded at a co_await because they ran past the time budget.
+  uint64_t budget_yields() const noexcept;
+
+  // Read the counters and the state of every thread.
+  scheduler_stats stats() const;
+
+  /* Call hook with stats() every interval from a thread of its own, an empty
+   * hook stops it. Not to be called from the hook itself.
+   */
+  void set_stats_hook(std::function<void(const scheduler_stats &)> hook,
+                      std::chrono::milliseconds interval);
+
+  const cpu_topology &topology() const noexcept { return m_topology; }
 
 protected:
-  void init_thread();
-  void set_thread_suspended() noexcept;
-  void set_thread_ready() noexcept;
-  void set_thread_running() noexcept;
-  void set_thread_status(thread_status::STATUS status) noexcept;
+  bool spawn_worker();
+  void untrack(scheduler_root *root) noexcept;
+  void unlink(scheduler_root *root) noexcept;
+  void cancel_roots();
+  void reclaim_roots();
+  bool ran_dry() noexcept;
+  bool quiescent() const noexcept;
+  void stop_workers();
+  void free_contexts();
+  void stop_stats_hook();
+  uint64_t sum_counter(stat_counter thread_counters::*counter) const noexcept;
+  bool retire() noexcept;
 
   scheduler_task awaiter();
   std::coroutine_handle<> get_waiting_channel() noexcept;
   bool peek_next_coroutine(std::coroutine_handle<> &handle) noexcept;
+  bool find_task(std::coroutine_handle<> &handle) noexcept;
+  bool requeue_yielded() noexcept;
+  bool slice_expired() const noexcept;
+  bool dequeue_task(std::coroutine_handle<> &handle) noexcept;
   bool steal_task(std::coroutine_handle<> &handle) noexcept;
+  size_t drain_injection() noexcept;
+  void build_victims(unsigned int total_threads);
+  void init_placement(const placement_config &placement);
+  void init(unsigned int min_threads, unsigned int max_threads);
+  void pin_worker() noexcept;
+  unsigned int poll_pollables() noexcept;
+  bool pollables_pending() noexcept;
+  void wait_pollables() noexcept;
+  void wake_io_sleeper() noexcept;
+  void wake_all_io_sleepers() noexcept;
+  bool has_queued_tasks() const noexcept;
+  bool has_local_tasks() const noexcept;
+  bool spin_for_task(std::coroutine_handle<> &handle) noexcept;
+  bool park() noexcept;
+  void wake_workers(size_t tasks) noexcept;
+  bool unpark_one() noexcept;
+  void unpark_all() noexcept;
 };
 
+inline void scheduler_root::release() noexcept {
+  if (m_scheduler.load(std::memory_order_relaxed) == nullptr) {
+    return;
+  }
+  // Whoever clears m_scheduler unlinks the root, us or a shutdown.
+  if (scheduler *s = m_scheduler.exchange(nullptr, std::memory_order_acq_rel)) {
+    s->untrack(this);
+  }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include "scheduler.hpp"
+
+#include <ostream>
+#include <pthread.h>
+
+namespace {
+
+const char *state(const thread_stats &stats) {
+  if (stats.id == 0) {
+    return "foreign";
+  }
+  if (stats.retired) {
+    return "retired";
+  }
+  return stats.parked ? "parked" : "running";
+}
+
+template <typename T, size_t N>
+void print_lanes(std::ostream &os, const std::array<T, N> &lanes) {
+  for (size_t lane = 0; lane < N; ++lane) {
+    os << (lane == 0 ? "" : "/") << lanes[lane];
+  }
+}
+
+void print_counters(std::ostream &os, const thread_stats &stats) {
+  os << " queued=";
+  print_lanes(os, stats.queued);
+  os << " tasks=" << stats.tasks << " steal_attempts=" << stats.steal_attempts
+     << " local_steals=" << stats.local_steals
+     << " remote_steals=" << stats.remote_steals << " stolen=" << stats.stolen
+     << " injected=" << stats.injected << " parks=" << stats.parks
+     << " wakeups=" << stats.wakeups << " idle_ms="
+     << std::chrono::duration_cast<std::chrono::milliseconds>(stats.idle)
+            .count()
+     << " long_slices=" << stats.long_slices
+     << " budget_yields=" << stats.budget_yields << "\n";
+}
+
+} // namespace
+
+thread_stats scheduler_stats::total() const noexcept {
+  thread_stats total;
+  for (auto &cxt : contexts) {
+    for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+      total.queued[lane] += cxt.queued[lane];
+    }
+    total.tasks          += cxt.tasks;
+    total.steal_attempts += cxt.steal_attempts;
+    total.local_steals   += cxt.local_steals;
+    total.remote_steals  += cxt.remote_steals;
+    total.stolen         += cxt.stolen;
+    total.injected       += cxt.injected;
+    total.parks          += cxt.parks;
+    total.wakeups        += cxt.wakeups;
+    total.idle           += cxt.idle;
+    total.long_slices    += cxt.long_slices;
+    total.budget_yields  += cxt.budget_yields;
+  }
+  return total;
+}
+
+std::ostream &operator<<(std::ostream &os, const scheduler_stats &stats) {
+  os << "scheduler threads=" << stats.threads
+     << " min_threads=" << stats.min_threads
+     << " max_threads=" << stats.max_threads
+     << " blocked=" << stats.blocked_threads
+     << " parked=" << stats.parked_threads
+     << " spinning=" << stats.spinning_threads
+     << " io_sleeping=" << stats.io_sleeping_threads << " injection=";
+  print_lanes(os, stats.injection_pending);
+  os << "\n";
+  for (auto &cxt : stats.contexts) {
+    os << "thread " << cxt.id << " cpu=" << cxt.cpu << " state=" << state(cxt);
+    print_counters(os, cxt);
+  }
+  os << "total";
+  print_counters(os, stats.total());
+  return os;
+}
+
+scheduler_stats scheduler::stats() const {
+  scheduler_stats stats;
+  stats.time                = std::chrono::steady_clock::now();
+  stats.threads             = m_active_threads.load(std::memory_order_relaxed);
+  stats.min_threads         = m_min_threads.load(std::memory_order_relaxed);
+  stats.max_threads         = m_max_threads;
+  stats.blocked_threads     = m_blocked_threads.load(std::memory_order_relaxed);
+  stats.parked_threads      = m_parked_count.load(std::memory_order_relaxed);
+  stats.spinning_threads    = m_spinning.load(std::memory_order_relaxed);
+  stats.io_sleeping_threads =
+      m_total_io_sleeping_threads.load(std::memory_order_relaxed);
+  for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+    stats.injection_pending[lane] = !m_injection[lane].empty();
+  }
+
+  auto total_threads = m_total_threads.load(std::memory_order_acquire);
+  stats.contexts.reserve(total_threads + 1);
+  for (unsigned int i = 0; i <= total_threads; ++i) {
+    const thread_context *cxt      = m_thread_cxts[i];
+    const thread_counters &counter = cxt->m_stats;
+
+    thread_stats &thread = stats.contexts.emplace_back();
+    thread.id            = i;
+    thread.cpu           = cxt->m_cpu != nullptr ? cxt->m_cpu->m_cpu : -1;
+    thread.retired       = cxt->m_retired.load(std::memory_order_relaxed);
+    thread.parked        = cxt->m_parked.load(std::memory_order_relaxed) != 0;
+    for (unsigned int lane = 0; lane < PRIORITY_LANES; ++lane) {
+      if (cxt->m_tasks[lane] != nullptr) {
+        thread.queued[lane] = cxt->m_tasks[lane]->size();
+      }
+    }
+    thread.local_steals   = counter.m_local_steals.load();
+    thread.remote_steals  = counter.m_remote_steals.load();
+    thread.steal_attempts = counter.m_steal_attempts.load();
+    thread.stolen         = counter.m_stolen.load();
+    thread.injected       = counter.m_injected.load();
+    thread.parks          = counter.m_parks.load();
+    thread.wakeups        = counter.m_wakeups.load();
+    thread.idle           = std::chrono::nanoseconds(counter.m_idle_ns.load());
+    thread.long_slices    = counter.m_long_slices.load();
+    thread.budget_yields  = counter.m_budget_yields.load();
+    thread.tasks =
+        counter.m_dequeues.load() + thread.local_steals + thread.remote_steals;
+  }
+  return stats;
+}
+
+void scheduler::set_stats_hook(
+    std::function<void(const scheduler_stats &)> hook,
+    std::chrono::milliseconds interval) {
+  stop_stats_hook();
+  if (!hook || interval <= std::chrono::milliseconds::zero()) {
+    return;
+  }
+  m_stats_stop   = false;
+  m_stats_thread = std::thread([this, hook = std::move(hook), interval] {
+    name_thread(pthread_self(), m_thread_name + "-stats");
+    std::unique_lock lk(m_stats_mutex);
+    while (!m_stats_cv.wait_for(lk, interval, [&] { return m_stats_stop; })) {
+      lk.unlock();
+      hook(stats());
+      lk.lock();
+    }
+  });
+}
+
+void scheduler::stop_stats_hook() {
+  {
+    std::unique_lock lk(m_stats_mutex);
+    m_stats_stop = true;
+  }
+  m_stats_cv.notify_all();
+  if (m_stats_thread.joinable()) {
+    m_stats_thread.join();
+  }
+}
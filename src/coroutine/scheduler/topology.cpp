@@ -0,0 +1,176 @@
+#include "topology.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <sched.h>
+#include <tuple>
+
+namespace {
+
+const std::string cpu_path = "/sys/devices/system/cpu/";
+
+std::string read_line(const std::string &path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+// Cpus in the list at path, or just cpu if it can not be read.
+std::vector<int> read_cpu_list(const std::string &path, int cpu) {
+  std::vector<int> cpus = cpu_topology::parse_cpu_list(read_line(path));
+  if (cpus.empty()) {
+    cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+// Cpus sharing the highest level cache of cpu.
+std::vector<int> last_level_cache(int cpu) {
+  std::string cache_path = cpu_path + "cpu" + std::to_string(cpu) + "/cache/";
+  std::vector<int> cpus{cpu};
+  int best_level = -1;
+  for (int index = 0;; ++index) {
+    std::string index_path = cache_path + "index" + std::to_string(index) + "/";
+    std::string level      = read_line(index_path + "level");
+    if (level.empty()) {
+      break;
+    }
+    if (atoi(level.c_str()) > best_level) {
+      best_level = atoi(level.c_str());
+      cpus       = read_cpu_list(index_path + "shared_cpu_list", cpu);
+    }
+  }
+  return cpus;
+}
+
+int numa_node(int cpu) {
+  DIR *dir = opendir((cpu_path + "cpu" + std::to_string(cpu)).c_str());
+  if (dir == nullptr) {
+    return 0;
+  }
+  int node = 0;
+  while (dirent *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(0, 4, "node") == 0) {
+      node = atoi(name.c_str() + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+} // namespace
+
+cpu_topology::cpu_topology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+  std::vector<int> online = parse_cpu_list(read_line(cpu_path + "online"));
+  for (int cpu : online) {
+    if (cpu >= CPU_SETSIZE || (masked && !CPU_ISSET(cpu, &allowed))) {
+      continue;
+    }
+    m_cpus.push_back(describe(cpu));
+  }
+
+  if (m_cpus.empty()) {
+    // No sysfs, keep the cpus the process may use without any grouping.
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (masked && CPU_ISSET(cpu, &allowed)) {
+        m_cpus.push_back(cpu_info{cpu, cpu, cpu, 0, 0});
+      }
+    }
+  }
+  if (m_cpus.empty()) {
+    m_cpus.push_back(cpu_info{0, 0, 0, 0, 0});
+  }
+
+  std::stable_sort(m_cpus.begin(), m_cpus.end(),
+                   [](const cpu_info &a, const cpu_info &b) {
+                     return std::tie(a.m_node, a.m_cache, a.m_sibling,
+                                     a.m_core, a.m_cpu) <
+                            std::tie(b.m_node, b.m_cache, b.m_sibling,
+                                     b.m_core, b.m_cpu);
+                   });
+}
+
+cpu_info cpu_topology::describe(int cpu) {
+  std::string topology_path =
+      cpu_path + "cpu" + std::to_string(cpu) + "/topology/";
+  std::vector<int> siblings =
+      read_cpu_list(topology_path + "thread_siblings_list", cpu);
+  std::vector<int> cache = last_level_cache(cpu);
+
+  cpu_info info;
+  info.m_cpu     = cpu;
+  info.m_core    = siblings.front();
+  info.m_cache   = cache.front();
+  info.m_node    = numa_node(cpu);
+  info.m_sibling = std::find(siblings.begin(), siblings.end(), cpu) -
+                   siblings.begin();
+  return info;
+}
+
+CPU_DISTANCE cpu_topology::distance(const cpu_info &a,
+                                    const cpu_info &b) noexcept {
+  if (a.m_core == b.m_core) {
+    return CPU_DISTANCE::CORE;
+  }
+  if (a.m_cache == b.m_cache) {
+    return CPU_DISTANCE::CACHE;
+  }
+  if (a.m_node == b.m_node) {
+    return CPU_DISTANCE::NODE;
+  }
+  return CPU_DISTANCE::REMOTE;
+}
+
+std::vector<int> cpu_topology::parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  const char *pos = list.c_str();
+  while (*pos != '\0') {
+    char *end;
+    long first = strtol(pos, &end, 10);
+    long last  = first;
+    if (end == pos) {
+      return {};
+    }
+    if (*end == '-') {
+      pos  = end + 1;
+      last = strtol(pos, &end, 10);
+      if (end == pos) {
+        return {};
+      }
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    pos = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return {};
+    }
+  }
+  return cpus;
+}
+
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus) noexcept {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return CPU_COUNT(&set) != 0 &&
+         pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+void name_thread(pthread_t thread, const std::string &name) noexcept {
+  // Longer names are refused, not truncated.
+  pthread_setname_np(thread, name.substr(0, 15).c_str());
+}
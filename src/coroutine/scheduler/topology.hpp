@@ -0,0 +1,81 @@
+#ifndef __CORO_SCHEDULER_TOPOLOGY_HPP__
+#define __CORO_SCHEDULER_TOPOLOGY_HPP__
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// How far apart two cpus are, from sharing a core to sitting on another node.
+enum class CPU_DISTANCE { CORE, CACHE, NODE, REMOTE };
+
+/* Groups are named after their lowest cpu, m_sibling is the position of the
+ * cpu among the hardware threads of its core.
+ */
+struct cpu_info {
+  int m_cpu     = -1;
+  int m_core    = -1;
+  int m_cache   = -1;
+  int m_node    = -1;
+  int m_sibling = 0;
+};
+
+/* Cpus the process may run on, read from /sys/devices/system/cpu. They are
+ * ordered so that consecutive placement slots fill the physical cores of one
+ * last level cache, then its remaining hardware threads, then the next cache
+ * and node. Without sysfs every cpu is its own core on a single node.
+ */
+class cpu_topology {
+  std::vector<cpu_info> m_cpus;
+
+public:
+  cpu_topology();
+
+  size_t size() const noexcept { return m_cpus.size(); }
+
+  // Cpu of placement slot i, wrapping around once every cpu is used.
+  const cpu_info &slot(size_t i) const noexcept {
+    return m_cpus[i % m_cpus.size()];
+  }
+
+  // Describe any online cpu, including those outside the affinity mask.
+  static cpu_info describe(int cpu);
+
+  static CPU_DISTANCE distance(const cpu_info &a, const cpu_info &b) noexcept;
+
+  // Parse a cpu list such as "0-3,8,10-11".
+  static std::vector<int> parse_cpu_list(const std::string &list);
+};
+
+/* Where the threads of a scheduler or io_service run.
+ *
+ * TOPOLOGY       : One cpu per worker in topology order, the physical cores
+ *                  of a cache first, then their other hardware threads.
+ * PHYSICAL_CORES : One worker per physical core, on its first hardware
+ *                  thread. Hyperthread siblings are left alone.
+ * CPUSET         : Workers take the cpus of the set in order, one each. The
+ *                  cpus may be outside the affinity mask, e.g. isolcpus.
+ * NONE           : No pinning, the kernel places the threads.
+ *
+ * Workers past the number of cpus wrap around. An io_service pins its CQ
+ * thread to the whole set with CPUSET and leaves it alone otherwise.
+ */
+enum class PLACEMENT { TOPOLOGY, PHYSICAL_CORES, CPUSET, NONE };
+
+struct placement_config {
+  PLACEMENT policy = PLACEMENT::TOPOLOGY;
+
+  // Cpus of CPUSET.
+  std::vector<int> cpus;
+
+  // Thread name, empty for the default of the owner. Workers get "-<n>"
+  // appended, the kernel keeps the first 15 characters.
+  std::string name;
+};
+
+// Pin thread to cpus, false if the kernel refused the set.
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus) noexcept;
+
+// Name thread as it shows in top and perf.
+void name_thread(pthread_t thread, const std::string &name) noexcept;
+
+#endif
@@ -14,7 +14,10 @@ struct task_awaiter {
   auto await_suspend(const std::coroutine_handle<> &handle) const noexcept
       -> std::coroutine_handle<> {
     m_promise->m_continuation = handle;
-    return std::coroutine_handle<Promise>::from_promise(*m_promise);
+    auto child = std::coroutine_handle<Promise>::from_promise(*m_promise);
+    return m_promise->m_scheduler != nullptr
+               ? m_promise->m_scheduler->transfer_to(child)
+               : child;
   }
 
   constexpr Return await_resume() const noexcept { return m_promise->m_value; }
@@ -33,7 +36,10 @@ struct task_awaiter<Promise, void> {
   auto await_suspend(const std::coroutine_handle<> &handle) const noexcept
       -> std::coroutine_handle<> {
     m_promise->m_continuation = handle;
-    return std::coroutine_handle<Promise>::from_promise(*m_promise);
+    auto child = std::coroutine_handle<Promise>::from_promise(*m_promise);
+    return m_promise->m_scheduler != nullptr
+               ? m_promise->m_scheduler->transfer_to(child)
+               : child;
   }
 
   constexpr void await_resume() const noexcept {}
@@ -55,7 +61,9 @@ struct task_final_awaiter {
                                                 std::memory_order_acquire)) {
       m_promise->m_cancel_scheduler->schedule(m_promise->m_cancel_continuation);
     }
-    return m_promise->m_continuation;
+    return m_promise->m_scheduler != nullptr
+               ? m_promise->m_scheduler->transfer_to(m_promise->m_continuation)
+               : m_promise->m_continuation;
   }
 
   constexpr void await_resume() const noexcept {}
@@ -92,11 +100,18 @@ struct task {
     Other.m_promise = nullptr;
   }
   task &operator=(task &&Other) {
-    this->m_promise = Other.m_promise;
-    Other.m_promise = nullptr;
+    if (this != &Other) {
+      // The frame held so far is dropped like in the destructor.
+      destroy();
+      this->m_promise = Other.m_promise;
+      Other.m_promise = nullptr;
+    }
     return *this;
   }
 
+  // The frame stays suspended at its final suspend until the task is gone.
+  ~task() { destroy(); }
+
   auto operator co_await() {
     return task_awaiter<promise_type, Return>{m_promise};
   }
@@ -107,6 +122,14 @@ struct task {
     m_promise->m_stop_source.request_stop();
     return cancel_awaiter<promise_type>(m_promise);
   }
+
+protected:
+  void destroy() noexcept {
+    if (m_promise != nullptr) {
+      std::coroutine_handle<promise_type>::from_promise(*m_promise).destroy();
+      m_promise = nullptr;
+    }
+  }
 };
 
 template <>
@@ -137,11 +160,18 @@ struct task<void> {
     Other.m_promise = nullptr;
   }
   task &operator=(task &&Other) {
-    this->m_promise = Other.m_promise;
-    Other.m_promise = nullptr;
+    if (this != &Other) {
+      // The frame held so far is dropped like in the destructor.
+      destroy();
+      this->m_promise = Other.m_promise;
+      Other.m_promise = nullptr;
+    }
     return *this;
   }
 
+  // The frame stays suspended at its final suspend until the task is gone.
+  ~task() { destroy(); }
+
   auto operator co_await() {
     return task_awaiter<promise_type, void>{m_promise};
   }
@@ -152,6 +182,14 @@ struct task<void> {
     m_promise->m_stop_source.request_stop();
     return cancel_awaiter<promise_type>(m_promise);
   }
+
+protected:
+  void destroy() noexcept {
+    if (m_promise != nullptr) {
+      std::coroutine_handle<promise_type>::from_promise(*m_promise).destroy();
+      m_promise = nullptr;
+    }
+  }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "buffer_arena.hpp"
+#include "io_service.hpp"
+
+#include <iostream>
+#include <sys/mman.h>
+
+fixed_buffer &fixed_buffer::operator=(fixed_buffer &&Other) {
+  release();
+  m_arena      = Other.m_arena;
+  m_data       = Other.m_data;
+  m_size       = Other.m_size;
+  m_index      = Other.m_index;
+  m_size_class = Other.m_size_class;
+
+  Other.m_data = nullptr;
+
+  return *this;
+}
+
+void fixed_buffer::release() {
+  if (m_data != nullptr) {
+    m_arena->recycle(m_data, m_index, m_size_class);
+    m_data = nullptr;
+  }
+}
+
+buffer_arena::buffer_arena(io_service &io, size_t region_size,
+                           size_t slab_size)
+    : m_io_service(&io), m_region_size(region_size), m_slab_size(slab_size) {
+  size_t classes = 1;
+  for (size_t size = MIN_BLOCK; size < m_slab_size; size <<= 1) {
+    ++classes;
+  }
+  m_free.resize(classes);
+}
+
+buffer_arena::~buffer_arena() {
+  for (auto &region : m_regions) {
+    m_io_service->unregister_buffer(region.m_index);
+    munmap(region.m_base, m_region_size);
+  }
+}
+
+fixed_buffer buffer_arena::allocate(size_t size) {
+  unsigned int size_class = 0;
+  size_t block_size       = MIN_BLOCK;
+  while (block_size < size) {
+    block_size <<= 1;
+    ++size_class;
+  }
+  if (block_size > m_slab_size) [[unlikely]] {
+    return fixed_buffer();
+  }
+
+  std::unique_lock lk(m_mutex);
+  auto &blocks = m_free[size_class];
+  if (blocks.empty() && !add_slab(size_class)) [[unlikely]] {
+    return fixed_buffer();
+  }
+  block b = blocks.back();
+  blocks.pop_back();
+  m_in_use.fetch_add(1, std::memory_order_relaxed);
+  return fixed_buffer(this, b.m_data, block_size, b.m_index, size_class);
+}
+
+bool buffer_arena::add_slab(unsigned int size_class) {
+  region *last = m_regions.empty() ? nullptr : &m_regions.back();
+  if (last == nullptr || last->m_slabs_used * m_slab_size >= m_region_size) {
+    // Pages of a registered buffer are pinned, map them up front.
+    void *mapping = mmap(nullptr, m_region_size, PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+    if (mapping == MAP_FAILED) [[unlikely]] {
+      std::cerr << "Buffer region allocation failed\n";
+      return false;
+    }
+    int index = m_io_service->register_buffer(iovec{mapping, m_region_size});
+    if (index < 0) [[unlikely]] {
+      std::cerr << "Buffer region registration failed\n";
+      munmap(mapping, m_region_size);
+      return false;
+    }
+    m_regions.push_back(region{static_cast<char *>(mapping), index, 0});
+    last = &m_regions.back();
+  }
+
+  char *slab        = last->m_base + last->m_slabs_used++ * m_slab_size;
+  size_t block_size = MIN_BLOCK << size_class;
+  auto &blocks      = m_free[size_class];
+  // Blocks are taken from the back, hand out the slab front to back.
+  for (size_t offset = m_slab_size; offset > 0; offset -= block_size) {
+    blocks.push_back(block{slab + offset - block_size, last->m_index});
+  }
+  return true;
+}
+
+void buffer_arena::recycle(char *data, int index,
+                           unsigned int size_class) noexcept {
+  {
+    std::unique_lock lk(m_mutex);
+    m_free[size_class].push_back(block{data, index});
+  }
+  m_in_use.fetch_sub(1, std::memory_order_relaxed);
+}
@@ -0,0 +1,123 @@
+#ifndef __IO_BUFFER_ARENA_HPP__
+#define __IO_BUFFER_ARENA_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class io_service;
+class buffer_arena;
+
+/* Piece of a registered region handed out by buffer_arena. It carries the
+ * buf_index read_fixed and write_fixed need and goes back to the arena when
+ * destroyed.
+ */
+class fixed_buffer {
+  buffer_arena *m_arena     = nullptr;
+  char *m_data              = nullptr;
+  size_t m_size             = 0;
+  int m_index               = -1;
+  unsigned int m_size_class = 0;
+
+public:
+  fixed_buffer() = default;
+
+  fixed_buffer(buffer_arena *arena, char *data, size_t size, int index,
+               unsigned int size_class)
+      : m_arena{arena}
+      , m_data{data}
+      , m_size{size}
+      , m_index{index}
+      , m_size_class{size_class} {}
+
+  fixed_buffer(const fixed_buffer &) = delete;
+  fixed_buffer &operator=(const fixed_buffer &) = delete;
+
+  fixed_buffer(fixed_buffer &&Other) { *this = std::move(Other); }
+
+  fixed_buffer &operator=(fixed_buffer &&Other);
+
+  ~fixed_buffer() { release(); }
+
+  // Give the buffer back to the arena right away.
+  void release();
+
+  char *data() const noexcept { return m_data; }
+
+  // Capacity, at least the size asked for.
+  size_t size() const noexcept { return m_size; }
+
+  // Slot of the registered buffer table holding the buffer.
+  int index() const noexcept { return m_index; }
+
+  operator bool() const noexcept { return m_data != nullptr; }
+};
+
+/* Registered memory for fixed reads and writes. Regions of region_size bytes
+ * are mapped and registered as a single slot of the buffer table, then carved
+ * into slabs of slab_size bytes. Each slab is split into blocks of one size
+ * class, powers of two from MIN_BLOCK up to slab_size, the first time that
+ * class runs dry. A new region is registered once every slab is in use.
+ */
+class buffer_arena {
+  struct region {
+    char *m_base;
+    int m_index;
+    size_t m_slabs_used;
+  };
+
+  struct block {
+    char *m_data;
+    int m_index;
+  };
+
+  io_service *m_io_service;
+  size_t m_region_size;
+  size_t m_slab_size;
+
+  std::vector<region> m_regions;
+  // Free blocks of each size class.
+  std::vector<std::vector<block>> m_free;
+  std::mutex m_mutex;
+
+  std::atomic_uint m_in_use{0};
+
+  friend class fixed_buffer;
+
+public:
+  static constexpr size_t MIN_BLOCK = 512;
+
+  // slab_size should be a power of 2 and region_size a multiple of it.
+  explicit buffer_arena(io_service &io, size_t region_size = 4 << 20,
+                        size_t slab_size = 64 << 10);
+
+  buffer_arena(const buffer_arena &) = delete;
+  buffer_arena &operator=(const buffer_arena &) = delete;
+
+  ~buffer_arena();
+
+  /* A buffer of at least size bytes. It is empty when size is above
+   * slab_size or when no more memory could be registered.
+   */
+  fixed_buffer allocate(size_t size);
+
+  // Buffers currently held by a fixed_buffer.
+  unsigned int in_use() const noexcept {
+    return m_in_use.load(std::memory_order_relaxed);
+  }
+
+  // Number of registered regions.
+  size_t regions() {
+    std::unique_lock lk(m_mutex);
+    return m_regions.size();
+  }
+
+protected:
+  bool add_slab(unsigned int size_class);
+
+  void recycle(char *data, int index, unsigned int size_class) noexcept;
+};
+
+#endif
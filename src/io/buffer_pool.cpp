@@ -0,0 +1,143 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <sys/mman.h>
+
+buffer_view &buffer_view::operator=(buffer_view &&Other) {
+  release();
+  m_pool   = Other.m_pool;
+  m_ring   = Other.m_ring;
+  m_data   = Other.m_data;
+  m_result = Other.m_result;
+  m_bid    = Other.m_bid;
+
+  Other.m_data = nullptr;
+
+  return *this;
+}
+
+void buffer_view::release() {
+  if (m_data != nullptr) {
+    m_pool->recycle(m_ring, m_bid);
+    m_data = nullptr;
+  }
+}
+
+buffer_pool::buffer_pool(io_service &io, unsigned int buffer_size,
+                         unsigned int buffer_count, int bgid)
+    : m_io_service(&io)
+    , m_buffer_size(buffer_size)
+    , m_buffer_count(buffer_count)
+    , m_bgid(bgid) {}
+
+buffer_pool::~buffer_pool() {
+  if (m_in_use.load(std::memory_order_relaxed) != 0) [[unlikely]] {
+    // Their memory goes away below, see the class comment.
+    std::cerr << "Buffer pool destroyed with " << in_use()
+              << " buffer views alive\n";
+  }
+  for (auto &ring : m_rings) {
+    io_uring_unregister_buf_ring(ring->m_uring, m_bgid);
+    munmap(ring->m_ring, m_buffer_count * sizeof(io_uring_buf));
+    delete[] ring->m_buffers;
+    delete ring;
+  }
+}
+
+ring_buffers *buffer_pool::ring_for(io_uring *uring) {
+  {
+    std::shared_lock lk(m_rings_mutex);
+    for (auto &ring : m_rings) {
+      if (ring->m_uring == uring) {
+        return ring;
+      }
+    }
+    if (std::find(m_failed.begin(), m_failed.end(), uring) != m_failed.end())
+        [[unlikely]] {
+      return nullptr;
+    }
+  }
+  return register_ring(uring);
+}
+
+ring_buffers *buffer_pool::register_ring(io_uring *uring) {
+  std::unique_lock lk(m_rings_mutex);
+  for (auto &ring : m_rings) {
+    if (ring->m_uring == uring) {
+      return ring;
+    }
+  }
+  if (std::find(m_failed.begin(), m_failed.end(), uring) != m_failed.end()) {
+    return nullptr;
+  }
+
+  // The buffer ring is shared with the kernel and has to be page aligned.
+  size_t ring_size = m_buffer_count * sizeof(io_uring_buf);
+  void *mapping    = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (mapping == MAP_FAILED) [[unlikely]] {
+    std::cerr << "Buffer ring allocation failed\n";
+    m_failed.push_back(uring);
+    return nullptr;
+  }
+
+  io_uring_buf_reg reg{};
+  reg.ring_addr    = reinterpret_cast<__u64>(mapping);
+  reg.ring_entries = m_buffer_count;
+  reg.bgid         = m_bgid;
+  if (io_uring_register_buf_ring(uring, &reg, 0) < 0) [[unlikely]] {
+    // Ops then fail with -ENOBUFS.
+    std::cerr << "Buffer ring registration failed\n";
+    munmap(mapping, ring_size);
+    m_failed.push_back(uring);
+    return nullptr;
+  }
+
+  auto ring       = new ring_buffers;
+  ring->m_uring   = uring;
+  ring->m_ring    = static_cast<io_uring_buf_ring *>(mapping);
+  ring->m_buffers = new char[static_cast<size_t>(m_buffer_size) *
+                             m_buffer_count];
+
+  io_uring_buf_ring_init(ring->m_ring);
+  int mask = io_uring_buf_ring_mask(m_buffer_count);
+  for (unsigned int bid = 0; bid < m_buffer_count; ++bid) {
+    io_uring_buf_ring_add(ring->m_ring,
+                          ring->m_buffers +
+                              static_cast<size_t>(bid) * m_buffer_size,
+                          m_buffer_size, bid, mask, bid);
+  }
+  io_uring_buf_ring_advance(ring->m_ring, m_buffer_count);
+
+  m_rings.push_back(ring);
+  return ring;
+}
+
+buffer_view buffer_pool::view(ring_buffers *ring, int result,
+                              unsigned int flags) noexcept {
+  if (result == -ENOBUFS) {
+    m_exhausted.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (ring == nullptr || !(flags & IORING_CQE_F_BUFFER)) {
+    return buffer_view(result);
+  }
+
+  m_in_use.fetch_add(1, std::memory_order_relaxed);
+  unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  return buffer_view(this, ring,
+                     ring->m_buffers + static_cast<size_t>(bid) * m_buffer_size,
+                     result, bid);
+}
+
+void buffer_pool::recycle(ring_buffers *ring, unsigned short bid) noexcept {
+  {
+    std::unique_lock lk(ring->m_mutex);
+    io_uring_buf_ring_add(ring->m_ring,
+                          ring->m_buffers +
+                              static_cast<size_t>(bid) * m_buffer_size,
+                          m_buffer_size, bid,
+                          io_uring_buf_ring_mask(m_buffer_count), 0);
+    io_uring_buf_ring_advance(ring->m_ring, 1);
+  }
+  m_in_use.fetch_sub(1, std::memory_order_relaxed);
+}
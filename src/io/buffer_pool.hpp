@@ -0,0 +1,191 @@
+#ifndef __IO_BUFFER_POOL_HPP__
+#define __IO_BUFFER_POOL_HPP__
+
+#include "io_service.hpp"
+
+#include <atomic>
+#include <liburing.h>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+class buffer_pool;
+
+/* Buffers of a pool registered on one ring. The kernel picks a buffer only
+ * when data arrives, and the buffer goes back to the ring by bumping its
+ * tail, no sqe involved.
+ */
+struct ring_buffers {
+  io_uring *m_uring         = nullptr;
+  io_uring_buf_ring *m_ring = nullptr;
+  char *m_buffers           = nullptr;
+  // Buffers can be recycled from any thread, the ring tail has one writer.
+  std::mutex m_mutex;
+};
+
+/* A buffer picked by the kernel for a read or recv. It holds the received
+ * bytes and is handed back to the ring when destroyed.
+ */
+class buffer_view {
+  buffer_pool *m_pool  = nullptr;
+  ring_buffers *m_ring = nullptr;
+  char *m_data         = nullptr;
+  int m_result         = 0;
+  unsigned short m_bid = 0;
+
+public:
+  buffer_view(int result) : m_result{result} {}
+
+  buffer_view(buffer_pool *pool, ring_buffers *ring, char *data, int result,
+              unsigned short bid)
+      : m_pool{pool}
+      , m_ring{ring}
+      , m_data{data}
+      , m_result{result}
+      , m_bid{bid} {}
+
+  buffer_view(const buffer_view &) = delete;
+  buffer_view &operator=(const buffer_view &) = delete;
+
+  buffer_view(buffer_view &&Other) { *this = std::move(Other); }
+
+  buffer_view &operator=(buffer_view &&Other);
+
+  ~buffer_view() { release(); }
+
+  // Return the buffer to the ring right away.
+  void release();
+
+  // Bytes received or -errno, -ENOBUFS when the pool was exhausted.
+  int result() const noexcept { return m_result; }
+
+  char *data() const noexcept { return m_data; }
+
+  size_t size() const noexcept {
+    return m_result > 0 ? static_cast<size_t>(m_result) : 0;
+  }
+
+  operator bool() const noexcept { return m_data != nullptr; }
+};
+
+/* Fixed size buffers registered with io_uring_register_buf_ring. Every ring
+ * the pool is used on (the shared one and each per-thread ring) gets its own
+ * set of buffer_count buffers under the same group id, registered the first
+ * time an op is submitted to it.
+ *
+ * The buffers are freed with the pool, every buffer_view has to be released
+ * or destroyed before it.
+ */
+class buffer_pool {
+  io_service *m_io_service;
+  unsigned int m_buffer_size;
+  unsigned int m_buffer_count;
+  int m_bgid;
+
+  std::vector<ring_buffers *> m_rings;
+  // Rings the buffers could not be registered on, not tried again.
+  std::vector<io_uring *> m_failed;
+  std::shared_mutex m_rings_mutex;
+
+  std::atomic_uint m_in_use{0};
+  std::atomic_uint64_t m_exhausted{0};
+
+  friend class buffer_view;
+
+public:
+  // buffer_count should be a power of 2.
+  buffer_pool(io_service &io, unsigned int buffer_size,
+              unsigned int buffer_count, int bgid);
+
+  buffer_pool(const buffer_pool &) = delete;
+  buffer_pool &operator=(const buffer_pool &) = delete;
+
+  ~buffer_pool();
+
+  unsigned int buffer_size() const noexcept { return m_buffer_size; }
+
+  int bgid() const noexcept { return m_bgid; }
+
+  // Buffers currently held by a buffer_view.
+  unsigned int in_use() const noexcept {
+    return m_in_use.load(std::memory_order_relaxed);
+  }
+
+  // Number of ops that failed because every buffer was in use.
+  uint64_t exhausted() const noexcept {
+    return m_exhausted.load(std::memory_order_relaxed);
+  }
+
+  template <typename Awaiter>
+  class buffer_awaiter {
+    Awaiter m_awaiter;
+    buffer_pool *m_pool;
+    ring_buffers *m_ring;
+
+  public:
+    buffer_awaiter(Awaiter &&awaiter, buffer_pool *pool, ring_buffers *ring)
+        : m_awaiter{std::move(awaiter)}, m_pool{pool}, m_ring{ring} {}
+
+    auto operator co_await() {
+      using awaiter_t = decltype(std::declval<Awaiter &>().operator co_await());
+      struct {
+        awaiter_t m_awaiter;
+        buffer_pool *m_pool;
+        ring_buffers *m_ring;
+        bool await_ready() noexcept { return m_awaiter.await_ready(); }
+
+        auto await_suspend(const std::coroutine_handle<> &handle) noexcept {
+          return m_awaiter.await_suspend(handle);
+        }
+
+        buffer_view await_resume() noexcept {
+          auto res = m_awaiter.await_resume();
+          return m_pool->view(m_ring, res.result, res.flags);
+        }
+      } awaiter{m_awaiter.operator co_await(), m_pool, m_ring};
+
+      return awaiter;
+    }
+
+    // Streams only: more buffers may follow.
+    operator bool() { return static_cast<bool>(m_awaiter); }
+
+    void cancel() { m_awaiter.cancel(); }
+
+    void via(scheduler *s) { m_awaiter.via(s); }
+  };
+
+  auto recv(const int &fd, const int &flags, unsigned char sqe_flags = 0) {
+    ring_buffers *ring = ring_for(m_io_service->submission_ring());
+    return buffer_awaiter<uring_awaiter>(
+        m_io_service->recv(fd, m_bgid, m_buffer_size, flags, sqe_flags), this,
+        ring);
+  }
+
+  auto read(const int &fd, const off_t &offset, unsigned char sqe_flags = 0) {
+    ring_buffers *ring = ring_for(m_io_service->submission_ring());
+    return buffer_awaiter<uring_awaiter>(
+        m_io_service->read(fd, m_bgid, m_buffer_size, offset, sqe_flags), this,
+        ring);
+  }
+
+  // One sqe receiving every message, awaited repeatedly like an io_stream.
+  auto recv_multishot(const int &fd, const int &flags,
+                      unsigned char sqe_flags = 0) {
+    ring_buffers *ring = ring_for(m_io_service->submission_ring());
+    return buffer_awaiter<io_stream<io_service>>(
+        m_io_service->recv_multishot(fd, m_bgid, flags, sqe_flags), this, ring);
+  }
+
+protected:
+  ring_buffers *ring_for(io_uring *uring);
+
+  ring_buffers *register_ring(io_uring *uring);
+
+  buffer_view view(ring_buffers *ring, int result, unsigned int flags) noexcept;
+
+  void recycle(ring_buffers *ring, unsigned short bid) noexcept;
+};
+
+#endif
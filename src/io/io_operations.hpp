@@ -1,15 +1,173 @@
 #ifndef __IO_IO_OPERATION_HPP__
 #define __IO_IO_OPERATION_HPP__
 
+#include "buffer_arena.hpp"
 #include "io_uring_op.hpp"
 
+#include <cerrno>
 #include <sys/timerfd.h>
+#include <utility>
 #include <vector>
 
+/* Results of a multishot op, awaited repeatedly the way a generator is:
+ *
+ *   auto connections = io.accept_multishot(fd, 0);
+ *   while (connections) {
+ *     int client = co_await connections;
+ *   }
+ *
+ * Dropping the stream cancels the op if it is still armed.
+ */
+template <typename IO_Service>
+class io_stream {
+  IO_Service *m_io_service = nullptr;
+  uring_stream *m_stream   = nullptr;
+  scheduler *m_scheduler   = nullptr;
+
+public:
+  io_stream(IO_Service *io_service, uring_stream *stream)
+      : m_io_service{io_service}, m_stream{stream} {}
+
+  io_stream(const io_stream &) = delete;
+  io_stream &operator=(const io_stream &) = delete;
+
+  io_stream(io_stream &&Other) {
+    m_io_service = Other.m_io_service;
+    m_stream     = Other.m_stream;
+    m_scheduler  = Other.m_scheduler;
+
+    Other.m_stream = nullptr;
+  }
+
+  io_stream &operator=(io_stream &&Other) {
+    if (this == &Other) {
+      return *this;
+    }
+    // The op held so far is dropped, cancel it as the destructor would.
+    reset();
+
+    m_io_service = Other.m_io_service;
+    m_stream     = Other.m_stream;
+    m_scheduler  = Other.m_scheduler;
+
+    Other.m_stream = nullptr;
+
+    return *this;
+  }
+
+  ~io_stream() { reset(); }
+
+  auto operator co_await() {
+    struct {
+      uring_stream *m_stream;
+      scheduler *m_scheduler;
+      bool await_ready() const noexcept { return m_stream->ready(); }
+
+      auto await_suspend(const std::coroutine_handle<> &handle) noexcept
+          -> std::coroutine_handle<> {
+        if (!m_stream->suspend(handle, m_scheduler)) {
+          return m_scheduler->transfer_to(handle);
+        }
+        return m_scheduler->get_next_coroutine();
+      }
+
+      auto await_resume() const noexcept {
+        auto [res, flags] = m_stream->pop();
+        struct {
+          int result;
+          unsigned int flags;
+          operator int() { return result; }
+        } result{res, flags};
+        return result;
+      }
+    } awaiter{m_stream, m_scheduler};
+
+    return awaiter;
+  }
+
+  // Ask the kernel to stop the op, the last result is then -ECANCELED.
+  void cancel() { m_io_service->cancel_stream(*m_stream); }
+
+  void via(scheduler *s) { m_scheduler = s; }
+
+  operator bool() { return m_stream != nullptr && !m_stream->done(); }
+
+protected:
+  void reset() {
+    if (m_stream != nullptr) {
+      if (!m_stream->finished() && !m_io_service->cancel_stream(*m_stream)) {
+        // The ring keeps the stream alive and cancels the op once it shows.
+        m_stream->orphan();
+      }
+      m_stream->release();
+      m_stream = nullptr;
+    }
+  }
+};
+
+/* Result of an op creating a direct descriptor, resumes with the fixed_fd
+ * bound to the ring the op ran on.
+ */
+class fixed_fd_awaiter {
+  uring_awaiter m_awaiter;
+  io_uring *m_uring;
+
+public:
+  fixed_fd_awaiter(uring_awaiter &&awaiter, io_uring *uring)
+      : m_awaiter{std::move(awaiter)}, m_uring{uring} {}
+
+  auto operator co_await() {
+    using awaiter_t =
+        decltype(std::declval<uring_awaiter &>().operator co_await());
+    struct {
+      awaiter_t m_awaiter;
+      io_uring *m_uring;
+      bool await_ready() noexcept { return m_awaiter.await_ready(); }
+
+      auto await_suspend(const std::coroutine_handle<> &handle) noexcept {
+        return m_awaiter.await_suspend(handle);
+      }
+
+      fixed_fd await_resume() noexcept {
+        int res = m_awaiter.await_resume();
+        return fixed_fd{res, res >= 0 ? m_uring : nullptr};
+      }
+    } awaiter{m_awaiter.operator co_await(), m_uring};
+
+    return awaiter;
+  }
+
+  void via(scheduler *s) { m_awaiter.via(s); }
+};
+
 template <typename IO_SERVICE>
 class io_operation {
   IO_SERVICE *m_io_service;
 
+  // A direct descriptor only exists on its own ring, anywhere else the op
+  // would hit whatever file sits in that slot.
+  template <IO_URING_OP OP>
+  auto submit_fixed(const fixed_fd &fd, OP &&operation) -> uring_awaiter {
+    if (!m_io_service->fixed_usable(fd)) [[unlikely]] {
+      return m_io_service->complete_now(std::forward<OP>(operation), -EBADF);
+    }
+    return m_io_service->submit_io(std::forward<OP>(operation));
+  }
+
+  template <IO_URING_OP OP>
+  auto submit_direct(OP &&operation) -> fixed_fd_awaiter {
+    // The kernel picks the slot in the file table of the ring.
+    int res = m_io_service->enable_file_table();
+    if (res < 0) [[unlikely]] {
+      return fixed_fd_awaiter(
+          m_io_service->complete_now(std::forward<OP>(operation), res),
+          nullptr);
+    }
+    io_uring *uring = m_io_service->submission_ring();
+    return fixed_fd_awaiter(
+        m_io_service->submit_io(std::forward<OP>(operation)), uring);
+  }
+
 public:
   explicit io_operation(IO_SERVICE *service) : m_io_service{service} {}
 
@@ -51,12 +209,27 @@ public:
         io_uring_op_openat_t(dfd, filename, flags, mode, sqe_flags));
   }
 
+  // Open into a slot of the registered file table instead of an fd.
+  auto openat_direct(const int &dfd, const char *const &filename,
+                     const int &flags, const mode_t &mode,
+                     unsigned char sqe_flags = 0) -> fixed_fd_awaiter {
+    return submit_direct(
+        io_uring_op_openat_direct_t(dfd, filename, flags, mode, sqe_flags));
+  }
+
   auto read(const int &fd, void *const &buffer, const unsigned &bytes,
             const off_t &offset, unsigned char sqe_flags = 0) -> uring_awaiter {
     return m_io_service->submit_io(
         io_uring_op_read_t(fd, buffer, bytes, offset, sqe_flags));
   }
 
+  auto read(const fixed_fd &fd, void *const &buffer, const unsigned &bytes,
+            const off_t &offset, unsigned char sqe_flags = 0) -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_read_t(fd.m_index, buffer, bytes,
+                                               offset, sqe_flags));
+  }
+
   auto read(const int &fd, const int &gbid, const unsigned &bytes,
             const off_t &offset, unsigned char sqe_flags = 0) -> uring_awaiter {
     return m_io_service->submit_io(
@@ -77,6 +250,23 @@ public:
         fd, buffer, bytes, offset, buf_index, sqe_flags));
   }
 
+  auto read_fixed(const int &fd, const fixed_buffer &buffer,
+                  const unsigned &bytes, const off_t &offset,
+                  unsigned char sqe_flags = 0) -> uring_awaiter {
+    return m_io_service->submit_io(io_uring_op_read_fixed_t(
+        fd, buffer.data(), bytes, offset, buffer.index(), sqe_flags));
+  }
+
+  auto read_fixed(const fixed_fd &fd, const fixed_buffer &buffer,
+                  const unsigned &bytes, const off_t &offset,
+                  unsigned char sqe_flags = 0) -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_read_fixed_t(fd.m_index, buffer.data(),
+                                                     bytes, offset,
+                                                     buffer.index(),
+                                                     sqe_flags));
+  }
+
   auto write(const int &fd, void *const &buffer, const unsigned &bytes,
              const off_t &offset, unsigned char sqe_flags = 0)
       -> uring_awaiter {
@@ -84,6 +274,14 @@ public:
         io_uring_op_write_t(fd, buffer, bytes, offset, sqe_flags));
   }
 
+  auto write(const fixed_fd &fd, void *const &buffer, const unsigned &bytes,
+             const off_t &offset, unsigned char sqe_flags = 0)
+      -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_write_t(fd.m_index, buffer, bytes,
+                                                offset, sqe_flags));
+  }
+
   auto writev(const int &fd, iovec *const &iovecs, const unsigned int &count,
               const off_t &offset, unsigned char &sqe_flags = 0)
       -> uring_awaiter {
@@ -98,12 +296,35 @@ public:
         fd, buffer, bytes, offset, buf_index, sqe_flags));
   }
 
+  auto write_fixed(const int &fd, const fixed_buffer &buffer,
+                   const unsigned &bytes, const off_t &offset,
+                   unsigned char sqe_flags = 0) -> uring_awaiter {
+    return m_io_service->submit_io(io_uring_op_write_fixed_t(
+        fd, buffer.data(), bytes, offset, buffer.index(), sqe_flags));
+  }
+
+  auto write_fixed(const fixed_fd &fd, const fixed_buffer &buffer,
+                   const unsigned &bytes, const off_t &offset,
+                   unsigned char sqe_flags = 0) -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_write_fixed_t(
+                                fd.m_index, buffer.data(), bytes, offset,
+                                buffer.index(), sqe_flags));
+  }
+
   auto recv(const int &fd, void *const &buffer, const size_t &length,
             const int &flags, unsigned char sqe_flags = 0) -> uring_awaiter {
     return m_io_service->submit_io(
         io_uring_op_recv_t(fd, buffer, length, flags, sqe_flags));
   }
 
+  auto recv(const fixed_fd &fd, void *const &buffer, const size_t &length,
+            const int &flags, unsigned char sqe_flags = 0) -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_recv_t(fd.m_index, buffer, length,
+                                               flags, sqe_flags));
+  }
+
   auto recv(const int &fd, const int &gbid, const size_t &length,
             const int &flags, unsigned char sqe_flags = 0) -> uring_awaiter {
     return m_io_service->submit_io(
@@ -117,16 +338,73 @@ public:
         io_uring_op_accept_t(fd, client_info, socklen, flags, sqe_flags));
   }
 
+  auto accept(const fixed_fd &fd, sockaddr *const &client_info,
+              socklen_t *const &socklen, const int &flags,
+              unsigned char sqe_flags = 0) -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_accept_t(fd.m_index, client_info,
+                                                 socklen, flags, sqe_flags));
+  }
+
+  // Accept into a slot of the registered file table instead of an fd.
+  auto accept_direct(const int &fd, const int &flags,
+                     unsigned char sqe_flags = 0) -> fixed_fd_awaiter {
+    return submit_direct(io_uring_op_accept_direct_t(fd, flags, sqe_flags));
+  }
+
+  auto accept_direct(const fixed_fd &fd, const int &flags,
+                     unsigned char sqe_flags = 0) -> fixed_fd_awaiter {
+    if (!m_io_service->fixed_usable(fd)) [[unlikely]] {
+      return fixed_fd_awaiter(
+          m_io_service->complete_now(
+              io_uring_op_accept_direct_t(fd.m_index, flags, sqe_flags),
+              -EBADF),
+          nullptr);
+    }
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_direct(
+        io_uring_op_accept_direct_t(fd.m_index, flags, sqe_flags));
+  }
+
+  // One sqe accepting every incoming connection, yields the client fds.
+  auto accept_multishot(const int &fd, const int &flags,
+                        unsigned char sqe_flags = 0) {
+    return m_io_service->submit_stream(
+        io_uring_op_accept_multishot_t(fd, flags, sqe_flags));
+  }
+
+  // One sqe receiving every message into buffers of group gbid, the buffer
+  // id of each result is in its flags.
+  auto recv_multishot(const int &fd, const int &gbid, const int &flags,
+                      unsigned char sqe_flags = 0) {
+    return m_io_service->submit_stream(
+        io_uring_op_recv_multishot_t(fd, gbid, flags, sqe_flags));
+  }
+
   auto send(const int &fd, void *const &buffer, const size_t &length,
             const int &flags, unsigned char sqe_flags = 0) -> uring_awaiter {
     return m_io_service->submit_io(
         io_uring_op_send_t(fd, buffer, length, flags, sqe_flags));
   }
 
+  auto send(const fixed_fd &fd, void *const &buffer, const size_t &length,
+            const int &flags, unsigned char sqe_flags = 0) -> uring_awaiter {
+    sqe_flags |= IOSQE_FIXED_FILE;
+    return submit_fixed(fd, io_uring_op_send_t(fd.m_index, buffer, length,
+                                               flags, sqe_flags));
+  }
+
   auto close(const int &fd, unsigned char sqe_flags = 0) -> uring_awaiter {
     return m_io_service->submit_io(io_uring_op_close_t(fd, sqe_flags));
   }
 
+  // Closes a direct descriptor, slots from register_fd() are released with
+  // unregister_fd() instead.
+  auto close(const fixed_fd &fd, unsigned char sqe_flags = 0)
+      -> uring_awaiter {
+    return submit_fixed(fd, io_uring_op_close_direct_t(fd.m_index, sqe_flags));
+  }
+
   auto statx(int dfd, const char *path, int flags, unsigned mask,
              struct statx *statxbuf, unsigned char sqe_flags = 0) {
     return m_io_service->submit_io(
@@ -166,6 +444,17 @@ public:
 
   std::vector<io_uring_op> &operations() { return m_io_operations; }
 
+  bool fixed_usable(const fixed_fd &fd) {
+    return m_io_service->fixed_usable(fd);
+  }
+
+  io_uring *submission_ring() { return m_io_service->submission_ring(); }
+
+  template <IO_URING_OP OP>
+  auto complete_now(OP &&operation, int result) -> uring_awaiter {
+    return m_io_service->complete_now(std::forward<OP>(operation), result);
+  }
+
   template <IO_URING_OP OP>
   auto submit_io(OP &&operation) -> uring_awaiter {
     auto future = operation.get_future(m_io_service->get_awaiter_allocator());
@@ -180,4 +469,37 @@ using io_batch = io_operation_detached<IO_Service, IO_OP_TYPE::BATCH>;
 template <typename IO_Service>
 using io_link = io_operation_detached<IO_Service, IO_OP_TYPE::LINK>;
 
+/* Ops issued through it are completed with -EBUSY instead of being held back
+ * when the SQ is full.
+ */
+template <typename IO_Service>
+class io_operation_fail_fast
+    : public io_operation<io_operation_fail_fast<IO_Service>> {
+  IO_Service *m_io_service;
+
+public:
+  explicit io_operation_fail_fast(IO_Service *io_service)
+      : io_operation<io_operation_fail_fast<IO_Service>>(this)
+      , m_io_service{io_service} {}
+
+  template <IO_URING_OP OP>
+  auto submit_io(OP &&operation) -> uring_awaiter {
+    return m_io_service->try_submit_io(std::forward<OP>(operation));
+  }
+
+  bool fixed_usable(const fixed_fd &fd) {
+    return m_io_service->fixed_usable(fd);
+  }
+
+  io_uring *submission_ring() { return m_io_service->submission_ring(); }
+
+  template <IO_URING_OP OP>
+  auto complete_now(OP &&operation, int result) -> uring_awaiter {
+    return m_io_service->complete_now(std::forward<OP>(operation), result);
+  }
+};
+
+template <typename IO_Service>
+using io_fail_fast = io_operation_fail_fast<IO_Service>;
+
 #endif
@@ -11,6 +11,11 @@ class io_op_pipeline {
   bool m_has_overflow_work = false;
 
 public:
+  // Link in the io_service list of pipelines waiting to be submitted, the
+  // flag keeps a pipeline from being listed twice.
+  io_op_pipeline *m_next = nullptr;
+  std::atomic_bool m_queued{false};
+
   io_op_pipeline(size_t capacity) : m_io_work_queue(capacity) {}
 
   template <typename T>
@@ -41,9 +46,10 @@ public:
     io_uring_op op;
     while (m_io_work_queue.dequeue(op)) {
       if (!std::visit(submit_operation, op)) {
-        return -1;
-        m_overflow_work     = op;
+        // Keep the op that did not get an sqe, it goes first next time.
+        m_overflow_work     = std::move(op);
         m_has_overflow_work = true;
+        return -1;
       } else {
         ++completed;
       }
@@ -51,7 +57,9 @@ public:
     return completed;
   }
 
-  bool empty() const noexcept { return m_io_work_queue.empty(); }
+  bool empty() const noexcept {
+    return !m_has_overflow_work && m_io_work_queue.empty();
+  }
 };
 
 #endif
\ No newline at end of file
@@ -1,48 +1,159 @@
 #include "io_service.hpp"
 
-thread_local unsigned int io_service::m_thread_id                    = 0;
-thread_local uring_data::allocator *io_service::m_uio_data_allocator = nullptr;
-thread_local io_op_pipeline *io_service::m_io_queue                  = nullptr;
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
-io_service::io_service(const u_int &entries, const u_int &flags)
-    : io_operation(this), m_entries(entries), m_flags(flags) {
-  io_uring_queue_init(entries, &m_uring, flags);
-  m_io_cq_thread = std::move(std::thread([&] { this->io_loop(); }));
+thread_local std::array<io_service::thread_slot, io_service::THREAD_SLOTS>
+    io_service::m_thread_slots{};
+thread_local unsigned int io_service::m_thread_slot_next = 0;
+std::atomic_uint64_t io_service::m_next_id{0};
+
+io_service::io_service(const u_int &entries, const u_int &flags,
+                       const placement_config &cq_placement)
+    : io_operation(this)
+    , m_entries(entries)
+    , m_flags(flags)
+    , m_cq_placement(cq_placement) {
+  io_uring_params params{};
+  params.flags = flags;
+  init_uring(params);
+}
+
+io_service::io_service(const u_int &entries, io_uring_params &params,
+                       const placement_config &cq_placement)
+    : io_operation(this)
+    , m_entries(entries)
+    , m_flags(params.flags)
+    , m_cq_placement(cq_placement) {
+  init_uring(params);
+}
+
+io_service::io_service(const u_int &entries, const sqpoll_config &config,
+                       const placement_config &cq_placement)
+    : io_operation(this)
+    , m_entries(entries)
+    , m_flags(IORING_SETUP_SQPOLL)
+    , m_cq_placement(cq_placement) {
+  io_uring_params params = config.params();
+  init_uring(params);
 }
 
-io_service::io_service(const u_int &entries, io_uring_params &params)
-    : io_operation(this), m_entries(entries) {
-  io_uring_queue_init_params(entries, &m_uring, &params);
+io_service::io_service(const u_int &entries, const u_int &flags,
+                       scheduler &schd, IO_RING_MODE mode,
+                       const placement_config &cq_placement)
+    : io_operation(this)
+    , m_mode(mode)
+    , m_scheduler(&schd)
+    , m_entries(entries)
+    , m_flags(flags)
+    , m_cq_placement(cq_placement) {
+  io_uring_params params{};
+  params.flags = flags;
+  init_uring(params);
+  m_scheduler->attach(this);
+}
+
+io_service::io_service(const u_int &entries, const sqpoll_config &config,
+                       scheduler &schd, IO_RING_MODE mode,
+                       const placement_config &cq_placement)
+    : io_operation(this)
+    , m_mode(mode)
+    , m_scheduler(&schd)
+    , m_entries(entries)
+    , m_flags(IORING_SETUP_SQPOLL)
+    , m_cq_placement(cq_placement) {
+  io_uring_params params = config.params();
+  init_uring(params);
+  m_scheduler->attach(this);
+}
+
+void io_service::init_uring(io_uring_params &params) {
+  m_sq_thread_cpu  = params.sq_thread_cpu;
+  m_sq_thread_idle = params.sq_thread_idle;
+
+  int res = io_uring_queue_init_params(m_entries, &m_uring, &params);
+  if (res < 0 && (params.flags & IORING_SETUP_SQPOLL)) [[unlikely]] {
+    // SQPOLL needs privileges on older kernels, run without it.
+    std::cerr << "SQPOLL setup failed (" << res << "), using plain ring\n";
+    m_flags = params.flags & ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF);
+    io_uring_params fallback{};
+    fallback.flags = m_flags;
+    io_uring_queue_init_params(m_entries, &m_uring, &fallback);
+    params = fallback;
+  }
+
+  m_sqpoll = m_uring.flags & IORING_SETUP_SQPOLL;
+  if (m_sqpoll && !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+    std::cerr << "Kernel SQPOLL only accepts registered files\n";
+  }
+
+  // The kernel refuses tables larger than the open file limit.
+  rlimit limit;
+  m_fixed_files = FIXED_FILES;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < m_fixed_files) {
+    m_fixed_files = limit.rlim_cur;
+  }
+  m_fixed_managed = m_fixed_files / 2;
+  m_fixed_fds.assign(m_fixed_managed, -1);
+  // Hand out the lowest slots first.
+  for (unsigned int index = m_fixed_managed; index > 0; --index) {
+    m_fixed_free.push_back(index - 1);
+  }
+
+  m_fixed_buffers.assign(FIXED_BUFFERS, iovec{nullptr, 0});
+  for (unsigned int index = FIXED_BUFFERS; index > 0; --index) {
+    m_fixed_buffers_free.push_back(index - 1);
+  }
+
   m_io_cq_thread = std::move(std::thread([&] { this->io_loop(); }));
+  name_thread(m_io_cq_thread.native_handle(),
+              m_cq_placement.name.empty() ? "zero-io-cq" : m_cq_placement.name);
+  if (m_cq_placement.policy == PLACEMENT::CPUSET &&
+      !pin_thread(m_io_cq_thread.native_handle(), m_cq_placement.cpus)) {
+    std::cerr << "Pinning the CQ thread failed\n";
+  }
 }
 
 io_service::~io_service() {
+  if (m_scheduler != nullptr) {
+    m_scheduler->detach(this);
+  }
   m_stop_requested.store(true, std::memory_order_relaxed);
   nop(IOSQE_IO_DRAIN);
   m_io_cq_thread.join();
+  // Slots other threads keep for this service are never matched again.
+  for (auto &[id, state] : m_thread_states) {
+    if (state->m_uring != nullptr) {
+      io_uring_queue_exit(state->m_uring);
+      delete state->m_uring;
+    }
+    delete state->m_io_queue;
+  }
+  for (auto &slot : m_thread_slots) {
+    if (slot.m_service == m_id) {
+      slot = thread_slot{};
+    }
+  }
+  for (auto &file : m_fixed_fds) {
+    if (file >= 0) {
+      ::close(file);
+    }
+  }
 }
 
 void io_service::io_loop() noexcept {
   while (!m_stop_requested.load(std::memory_order_relaxed)) {
     io_uring_cqe *cqe = nullptr;
-    if (io_uring_wait_cqe(&m_uring, &cqe) == 0) {
-      handle_completion(cqe);
-      io_uring_cqe_seen(&m_uring, cqe);
-    } else {
+    if (io_uring_wait_cqe(&m_uring, &cqe) != 0) {
       std::cerr << "Wait CQE Failed\n";
     }
-    unsigned completed = 0;
-    unsigned head;
-
-    io_uring_for_each_cqe(&m_uring, head, cqe) {
-      ++completed;
-      handle_completion(cqe);
-    }
-    if (completed) {
-      io_uring_cq_advance(&m_uring, completed);
+    // Idle workers may be reaping the shared ring as well.
+    {
+      std::unique_lock lk(m_cq_mutex);
+      reap_completions(&m_uring);
     }
-    if (m_io_queue_overflow.load(std::memory_order_relaxed) != nullptr)
-        [[unlikely]] {
+    if (m_sq_full.load(std::memory_order_relaxed)) [[unlikely]] {
       submit();
     }
   }
@@ -50,63 +161,548 @@ void io_service::io_loop() noexcept {
   return;
 }
 
-bool io_service::io_queue_empty() const noexcept {
-  bool is_empty = true;
-  for (auto &q : this->m_io_queues) {
-    is_empty = is_empty & q->empty();
+auto io_service::lookup_thread_state() const noexcept -> thread_state * {
+  thread_state *state = nullptr;
+  {
+    std::unique_lock lk(m_thread_context_mutex);
+    auto it = m_thread_states.find(std::this_thread::get_id());
+    if (it != m_thread_states.end()) {
+      state = it->second.get();
+    }
   }
-  return is_empty;
+  // Only the thread itself creates its state, so a miss stays valid until
+  // create_thread_state() replaces it.
+  cache_thread_state(state);
+  return state;
 }
 
-void io_service::setup_thread_context() {
-  if (m_thread_id == 0) {
-    m_thread_id = m_threads.fetch_add(1, std::memory_order_relaxed) + 1;
-    m_uio_data_allocator = new uring_data::allocator;
-    m_uio_data_allocators.push_back(m_uio_data_allocator);
-    m_io_queue = new io_op_pipeline(128);
-    m_io_queues.push_back(m_io_queue);
+void io_service::cache_thread_state(thread_state *state) const noexcept {
+  for (auto &slot : m_thread_slots) {
+    if (slot.m_service == m_id) {
+      slot.m_state = state;
+      return;
+    }
   }
+  auto &slot     = m_thread_slots[m_thread_slot_next++ % THREAD_SLOTS];
+  slot.m_service = m_id;
+  slot.m_state   = state;
 }
 
-void io_service::submit() {
-  while (!io_queue_empty() &&
-         !m_io_sq_running.exchange(true, std::memory_order_seq_cst)) {
-    auto overflow_queue = m_io_queue_overflow.load(std::memory_order_relaxed);
-    if (overflow_queue != nullptr) [[unlikely]] {
-      int res = overflow_queue->init_io_uring_ops(&m_uring);
-      if (res >= 0) {
-        m_io_queue_overflow.store(nullptr, std::memory_order_relaxed);
-      } else {
-        return;
+auto io_service::create_thread_state() -> thread_state & {
+  std::unique_lock lk(m_thread_context_mutex);
+  auto &state = m_thread_states[std::this_thread::get_id()];
+  if (state == nullptr) {
+    state                       = std::make_unique<thread_state>();
+    state->m_uio_data_allocator = new uring_data::allocator;
+    m_uio_data_allocators.push_back(state->m_uio_data_allocator);
+    state->m_io_queue = new io_op_pipeline(128);
+    if (m_mode == IO_RING_MODE::PER_THREAD && m_scheduler->is_worker_thread()) {
+      state->m_uring = setup_thread_uring();
+    }
+  }
+  cache_thread_state(state.get());
+  return *state;
+}
+
+io_uring *io_service::setup_thread_uring() {
+  io_uring_params params{};
+  params.flags = m_flags;
+  if (m_sqpoll) {
+    // Share the SQ thread of the main ring instead of one per worker.
+    params.flags |= IORING_SETUP_ATTACH_WQ;
+    params.wq_fd          = m_uring.ring_fd;
+    params.sq_thread_cpu  = m_sq_thread_cpu;
+    params.sq_thread_idle = m_sq_thread_idle;
+  }
+
+  io_uring *uring = new io_uring;
+  if (io_uring_queue_init_params(m_entries, uring, &params) < 0) [[unlikely]] {
+    // Fall back to the shared ring for this thread.
+    delete uring;
+    return nullptr;
+  }
+
+  // A ring missing a table could not run ops on registered files or buffers.
+  if (m_file_table.load(std::memory_order_relaxed)) {
+    if (register_file_table(uring) < 0) [[unlikely]] {
+      std::cerr << "File table registration failed\n";
+      io_uring_queue_exit(uring);
+      delete uring;
+      return nullptr;
+    }
+    if (m_fixed_free.size() != m_fixed_managed) {
+      // Slots registered before the ring existed.
+      io_uring_register_files_update(uring, 0, m_fixed_fds.data(),
+                                     m_fixed_managed);
+    }
+  }
+  if (m_buffer_table) {
+    int res = io_uring_register_buffers_sparse(uring, FIXED_BUFFERS);
+    if (res < 0) [[unlikely]] {
+      std::cerr << "Buffer table registration failed\n";
+      io_uring_queue_exit(uring);
+      delete uring;
+      return nullptr;
+    }
+    if (m_fixed_buffers_free.size() != m_fixed_buffers.size()) {
+      // Slots registered before the ring existed.
+      io_uring_register_buffers_update_tag(uring, 0, m_fixed_buffers.data(),
+                                           nullptr, m_fixed_buffers.size());
+    }
+  }
+  m_thread_urings.push_back(uring);
+  return uring;
+}
+
+int io_service::register_buffer_tables() {
+  if (m_buffer_table) {
+    return 0;
+  }
+  if (m_fixed_buffers.empty()) {
+    return -ENXIO;
+  }
+  int res = io_uring_register_buffers_sparse(&m_uring, FIXED_BUFFERS);
+  if (res < 0) [[unlikely]] {
+    // The kernel can not register buffers, do not try again.
+    std::cerr << "Buffer table registration failed (" << res << ")\n";
+    m_fixed_buffers.clear();
+    m_fixed_buffers_free.clear();
+    return res;
+  }
+  for (size_t i = 0; i < m_thread_urings.size(); ++i) {
+    res = io_uring_register_buffers_sparse(m_thread_urings[i], FIXED_BUFFERS);
+    if (res < 0) [[unlikely]] {
+      // Every ring has the table or none.
+      io_uring_unregister_buffers(&m_uring);
+      for (size_t done = 0; done < i; ++done) {
+        io_uring_unregister_buffers(m_thread_urings[done]);
       }
+      return res;
     }
+  }
+  m_buffer_table = true;
+  return 0;
+}
+
+int io_service::register_file_table(io_uring *uring) {
+  int res = io_uring_register_files_sparse(uring, m_fixed_files);
+  if (res < 0) [[unlikely]] {
+    return res;
+  }
+  // Keep the kernel from putting direct descriptors in the managed slots.
+  io_uring_register_file_alloc_range(uring, m_fixed_managed,
+                                     m_fixed_files - m_fixed_managed);
+  return 0;
+}
+
+int io_service::enable_file_table() {
+  if (m_file_table.load(std::memory_order_acquire)) [[likely]] {
+    return 0;
+  }
+  std::unique_lock lk(m_thread_context_mutex);
+  return register_file_tables();
+}
 
-    unsigned int completed = 0;
-    while (!io_queue_empty()) {
-      for (auto &q : m_io_queues) {
-        int res = q->init_io_uring_ops(&m_uring);
-        if (res < 0) [[unlikely]] {
-          m_io_queue_overflow.store(q, std::memory_order_relaxed);
-          return;
-        } else {
-          completed += res;
-        }
+int io_service::register_file_tables() {
+  if (m_file_table.load(std::memory_order_relaxed)) {
+    return 0;
+  }
+  if (m_fixed_files == 0) {
+    return -ENXIO;
+  }
+  int res = register_file_table(&m_uring);
+  if (res < 0) [[unlikely]] {
+    // The kernel can not register files, do not try again.
+    std::cerr << "File table registration failed (" << res << ")\n";
+    m_fixed_files   = 0;
+    m_fixed_managed = 0;
+    m_fixed_fds.clear();
+    m_fixed_free.clear();
+    return res;
+  }
+  for (size_t i = 0; i < m_thread_urings.size(); ++i) {
+    res = register_file_table(m_thread_urings[i]);
+    if (res < 0) [[unlikely]] {
+      // Every ring has the table or none.
+      io_uring_unregister_files(&m_uring);
+      for (size_t done = 0; done < i; ++done) {
+        io_uring_unregister_files(m_thread_urings[done]);
       }
+      return res;
     }
-    if (completed) {
-      io_uring_submit(&m_uring);
+  }
+  m_file_table.store(true, std::memory_order_release);
+  return 0;
+}
+
+fixed_fd io_service::register_fd(int fd) {
+  std::unique_lock lk(m_thread_context_mutex);
+  int res = register_file_tables();
+  if (res < 0) [[unlikely]] {
+    return fixed_fd{res};
+  }
+  if (m_fixed_free.empty()) [[unlikely]] {
+    return fixed_fd{-ENFILE};
+  }
+
+  // Rings created later are filled from m_fixed_fds, keep the file open even
+  // if the caller closes fd.
+  int file = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (file < 0) [[unlikely]] {
+    return fixed_fd{-errno};
+  }
+
+  unsigned int index = m_fixed_free.back();
+  res                = io_uring_register_files_update(&m_uring, index, &fd, 1);
+  if (res < 0) [[unlikely]] {
+    ::close(file);
+    return fixed_fd{res};
+  }
+  for (size_t i = 0; i < m_thread_urings.size(); ++i) {
+    res = io_uring_register_files_update(m_thread_urings[i], index, &fd, 1);
+    if (res < 0) [[unlikely]] {
+      // Clear the slot again rather than leave it set on some rings only.
+      int empty = -1;
+      io_uring_register_files_update(&m_uring, index, &empty, 1);
+      for (size_t done = 0; done < i; ++done) {
+        io_uring_register_files_update(m_thread_urings[done], index, &empty,
+                                       1);
+      }
+      ::close(file);
+      return fixed_fd{res};
     }
-    m_io_sq_running.store(false, std::memory_order_relaxed);
   }
+
+  m_fixed_free.pop_back();
+  m_fixed_fds[index] = file;
+  return fixed_fd{static_cast<int>(index)};
 }
 
-void io_service::handle_completion(io_uring_cqe *cqe) {
+int io_service::register_buffer(const iovec &buffer) {
+  std::unique_lock lk(m_thread_context_mutex);
+  int res = register_buffer_tables();
+  if (res < 0) [[unlikely]] {
+    return res;
+  }
+  if (m_fixed_buffers_free.empty()) [[unlikely]] {
+    return -ENOBUFS;
+  }
+
+  // No tags, a tag makes the kernel post a cqe once the old buffer of the
+  // slot is unused and cqes must carry a uring_data.
+  unsigned int index = m_fixed_buffers_free.back();
+  res = io_uring_register_buffers_update_tag(&m_uring, index, &buffer, nullptr,
+                                             1);
+  if (res < 0) [[unlikely]] {
+    return res;
+  }
+  for (size_t i = 0; i < m_thread_urings.size(); ++i) {
+    res = io_uring_register_buffers_update_tag(m_thread_urings[i], index,
+                                               &buffer, nullptr, 1);
+    if (res < 0) [[unlikely]] {
+      // Clear the slot again rather than leave it set on some rings only.
+      iovec empty{nullptr, 0};
+      io_uring_register_buffers_update_tag(&m_uring, index, &empty, nullptr,
+                                           1);
+      for (size_t done = 0; done < i; ++done) {
+        io_uring_register_buffers_update_tag(m_thread_urings[done], index,
+                                             &empty, nullptr, 1);
+      }
+      return res;
+    }
+  }
+
+  m_fixed_buffers_free.pop_back();
+  m_fixed_buffers[index] = buffer;
+  return index;
+}
+
+bool io_service::unregister_buffer(int index) {
+  std::unique_lock lk(m_thread_context_mutex);
+  if (index < 0 || static_cast<size_t>(index) >= m_fixed_buffers.size() ||
+      m_fixed_buffers[index].iov_base == nullptr) {
+    return false;
+  }
+
+  iovec empty{nullptr, 0};
+  io_uring_register_buffers_update_tag(&m_uring, index, &empty, nullptr, 1);
+  for (auto &uring : m_thread_urings) {
+    io_uring_register_buffers_update_tag(uring, index, &empty, nullptr, 1);
+  }
+
+  m_fixed_buffers[index] = empty;
+  m_fixed_buffers_free.push_back(index);
+  return true;
+}
+
+bool io_service::unregister_fd(fixed_fd &fd) {
+  std::unique_lock lk(m_thread_context_mutex);
+  if (fd.m_uring != nullptr || fd.m_index < 0 ||
+      static_cast<unsigned int>(fd.m_index) >= m_fixed_managed ||
+      m_fixed_fds[fd.m_index] < 0) {
+    return false;
+  }
+
+  int empty = -1;
+  io_uring_register_files_update(&m_uring, fd.m_index, &empty, 1);
+  for (auto &uring : m_thread_urings) {
+    io_uring_register_files_update(uring, fd.m_index, &empty, 1);
+  }
+
+  ::close(m_fixed_fds[fd.m_index]);
+  m_fixed_fds[fd.m_index] = -1;
+  m_fixed_free.push_back(fd.m_index);
+  fd.m_index = -1;
+  return true;
+}
+
+unsigned int io_service::poll() noexcept {
+  thread_state *state = find_thread_state();
+  if (state == nullptr || state->m_uring == nullptr) {
+    // Help the CQ thread unless it is already reaping.
+    std::unique_lock lk(m_cq_mutex, std::try_to_lock);
+    return lk.owns_lock() ? reap_completions(&m_uring) : 0;
+  }
+
+  io_uring *uring       = state->m_uring;
+  io_op_pipeline *queue = state->m_io_queue;
+  flush_thread_ring(*state);
+  if (state->m_sq_full && queue->empty()) [[unlikely]] {
+    state->m_sq_full = false;
+    wake_sq_waiters();
+  }
+
+  unsigned int completed = reap_completions(uring, state);
+  state->m_inflight -= completed;
+  return completed;
+}
+
+void io_service::flush_thread_ring(thread_state &state) noexcept {
+  // Move ops that did not fit in the SQ, submitting once to make room.
+  io_uring *uring       = state.m_uring;
+  io_op_pipeline *queue = state.m_io_queue;
+  if (!queue->empty() && queue->init_io_uring_ops(uring) < 0) {
+    submit_uring(uring);
+    if (queue->init_io_uring_ops(uring) < 0 && !state.m_sq_full) {
+      state.m_sq_full = true;
+      m_sq_overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  if (io_uring_sq_ready(uring)) {
+    submit_uring(uring);
+  }
+}
+
+bool io_service::pending() const noexcept {
+  thread_state *state = find_thread_state();
+  return state != nullptr && state->m_uring != nullptr &&
+         state->m_inflight != 0;
+}
+
+bool io_service::wait(int wake_fd,
+                      const std::chrono::nanoseconds &timeout) noexcept {
+  thread_state *state = find_thread_state();
+  if (state == nullptr || state->m_uring == nullptr || wake_fd < 0) {
+    return false;
+  }
+  io_uring *uring = state->m_uring;
+
+  // Keep a read armed on the wake eventfd so that a schedule() from another
+  // thread completes it and ends the wait, the kernel also drains the fd.
+  if (!state->m_wake_armed) {
+    io_uring_sqe *sqe = io_uring_get_sqe(uring);
+    if (sqe == nullptr) [[unlikely]] {
+      return false;
+    }
+    io_uring_prep_read(sqe, wake_fd, &state->m_wake_buffer,
+                       sizeof(state->m_wake_buffer), 0);
+    io_uring_sqe_set_data(sqe, &state->m_wake_buffer);
+    state->m_wake_armed = true;
+  }
+
+  auto sec  = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+  auto nsec = timeout - sec;
+  __kernel_timespec ts{sec.count(), nsec.count()};
+
+  // Submits whatever is still pending and sleeps in io_uring_enter.
+  io_uring_cqe *cqe = nullptr;
+  io_uring_wait_cqe_timeout(uring, &cqe, &ts);
+  return true;
+}
+
+void io_service::submit_uring(io_uring *const uring) noexcept {
+  if (m_sqpoll) {
+    // Publishing the tail is enough while the SQ thread is awake, the kernel
+    // is only entered (by io_uring_submit) to wake it up after sq_thread_idle.
+    std::atomic_ref<unsigned> sq_flags(*uring->sq.kflags);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sq_flags.load(std::memory_order_relaxed) & IORING_SQ_NEED_WAKEUP) {
+      m_sqpoll_wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  io_uring_submit(uring);
+}
+
+unsigned int io_service::reap_completions(io_uring *uring,
+                                          thread_state *state) noexcept {
+  unsigned int completed = 0;
+  unsigned int seen      = 0;
+  ready_batch ready;
+  unsigned head;
+  io_uring_cqe *cqe;
+  io_uring_for_each_cqe(uring, head, cqe) {
+    ++seen;
+    void *data = io_uring_cqe_get_data(cqe);
+    if (state != nullptr && data == &state->m_wake_buffer) {
+      state->m_wake_armed = false;
+    } else if (cqe->user_data != LIBURING_UDATA_TIMEOUT) {
+      // A multishot op is in flight until its last cqe.
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        ++completed;
+      }
+      handle_completion(cqe, ready);
+    }
+  }
+  if (seen) {
+    io_uring_cq_advance(uring, seen);
+  }
+  ready.flush();
+  return completed;
+}
+
+void io_service::submit() {
+  thread_state *state = find_thread_state();
+  if (state != nullptr && state->m_uring != nullptr) {
+    // Ops of a thread owning a ring are flushed by its next poll().
+    return;
+  }
+  if (state != nullptr) {
+    queue_pipeline(state->m_io_queue);
+  }
+  submit_pipelines();
+}
+
+void io_service::submit_pipelines() noexcept {
+  if (m_submit_requests.fetch_add(1, std::memory_order_acq_rel) != 0) {
+    // The current combiner will see our ops before it leaves.
+    return;
+  }
+
+  unsigned int requests;
+  do {
+    requests = m_submit_requests.load(std::memory_order_acquire);
+    drain_pipelines();
+  } while (m_submit_requests.fetch_sub(requests, std::memory_order_acq_rel) !=
+           requests);
+}
+
+void io_service::queue_pipeline(io_op_pipeline *queue) noexcept {
+  if (queue->m_queued.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  io_op_pipeline *head = m_ready_queues.load(std::memory_order_relaxed);
+  do {
+    queue->m_next = head;
+  } while (!m_ready_queues.compare_exchange_weak(
+      head, queue, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void io_service::drain_pipelines() noexcept {
+  io_op_pipeline *queues =
+      m_ready_queues.exchange(nullptr, std::memory_order_acquire);
+
+  // The list is LIFO, reverse it so pipelines are served in arrival order.
+  io_op_pipeline *ordered = nullptr;
+  while (queues != nullptr) {
+    io_op_pipeline *next = queues->m_next;
+    queues->m_next       = ordered;
+    ordered              = queues;
+    queues               = next;
+  }
+
+  bool held_back = false;
+  while (ordered != nullptr) {
+    io_op_pipeline *queue = ordered;
+    ordered               = ordered->m_next;
+
+    // Unlist before draining so an enqueue racing with us lists it again.
+    queue->m_queued.exchange(false, std::memory_order_acq_rel);
+    if (queue->init_io_uring_ops(&m_uring) < 0) [[unlikely]] {
+      // SQ is full, hand the prepared sqes to the kernel and try again.
+      submit_uring(&m_uring);
+      if (queue->init_io_uring_ops(&m_uring) < 0) {
+        queue_pipeline(queue);
+        held_back = true;
+      }
+    }
+  }
+
+  if (io_uring_sq_ready(&m_uring)) {
+    submit_uring(&m_uring);
+  }
+
+  if (held_back) [[unlikely]] {
+    if (!m_sq_full.exchange(true, std::memory_order_relaxed)) {
+      m_sq_overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+  } else if (m_sq_full.load(std::memory_order_relaxed) &&
+             m_sq_full.exchange(false, std::memory_order_relaxed)) {
+    wake_sq_waiters();
+  }
+}
+
+auto io_service::wait_sq_space(const std::coroutine_handle<> &handle,
+                               scheduler *schd) noexcept
+    -> std::coroutine_handle<> {
+  if (schd == nullptr) {
+    return handle;
+  }
+  {
+    // Checked under the lock, so a wake up racing with us can not be missed.
+    std::unique_lock lk(m_sq_waiters_mutex);
+    if (!sq_full()) {
+      return handle;
+    }
+    m_sq_waiters.emplace_back(handle, schd);
+  }
+  m_sq_waits.fetch_add(1, std::memory_order_relaxed);
+  return schd->get_next_coroutine();
+}
+
+void io_service::wake_sq_waiters() noexcept {
+  std::vector<std::pair<std::coroutine_handle<>, scheduler *>> waiters;
+  {
+    std::unique_lock lk(m_sq_waiters_mutex);
+    waiters.swap(m_sq_waiters);
+  }
+  for (auto &[handle, schd] : waiters) {
+    schd->schedule(handle);
+  }
+}
+
+// Cancel the op of data on uring and wait until it is gone.
+static int sync_cancel(io_uring *uring, uring_data *data) noexcept {
+  io_uring_sync_cancel_reg reg{};
+  reg.addr            = reinterpret_cast<__u64>(data);
+  reg.timeout.tv_sec  = -1;
+  reg.timeout.tv_nsec = -1;
+  return io_uring_register_sync_cancel(uring, &reg);
+}
+
+void io_service::handle_completion(io_uring_cqe *cqe, ready_batch &ready) {
   auto data = static_cast<uring_data *>(io_uring_cqe_get_data(cqe));
-  if (data != nullptr) {
+  if (data != nullptr && data->m_stream != nullptr) {
+    uring_stream *stream = data->m_stream;
+    // Armed after its consumer gave up on a cancel that missed it.
+    if ((cqe->flags & IORING_CQE_F_MORE) && stream->take_orphan()) {
+      sync_cancel(stream->m_uring, data);
+    }
+    stream->push(cqe->res, cqe->flags);
+  } else if (data != nullptr) {
     data->m_result = cqe->res;
     data->m_flags  = cqe->flags;
     if (data->m_handle_ctl.exchange(true, std::memory_order_acq_rel)) {
-      data->m_scheduler->schedule(data->m_handle);
+      ready.add(data->m_scheduler, data->m_priority, data->m_handle);
     }
     if (data->m_destroy_ctl.exchange(true, std::memory_order_relaxed)) {
       data->destroy();
@@ -114,8 +710,43 @@ void io_service::handle_completion(io_uring_cqe *cqe) {
   }
 }
 
+bool io_service::cancel_stream(uring_stream &stream) noexcept {
+  /* The op may sit on the ring of another thread, which an async cancel from
+   * here could not reach. Until it reaches the kernel the op is not found
+   * either: it may be held back in a pipeline, or prepared in the SQ of a
+   * ring whose owner has not submitted yet. Flush what this thread can and
+   * retry until the op is found or has finished.
+   */
+  auto deadline = std::chrono::steady_clock::now() + STREAM_CANCEL_TIMEOUT;
+  while (true) {
+    thread_state *state = find_thread_state();
+    bool flushed        = false;
+    if (stream.m_uring == &m_uring) {
+      submit_pipelines();
+    } else if (state != nullptr && stream.m_uring == state->m_uring) {
+      flush_thread_ring(*state);
+      flushed =
+          state->m_io_queue->empty() && !io_uring_sq_ready(state->m_uring);
+    }
+    int ret = sync_cancel(stream.m_uring, stream.m_data);
+    // Gone from a ring fully handed to the kernel, its last cqe awaits us.
+    if (ret == 0 || stream.finished() || (ret == -ENOENT && flushed)) {
+      return true;
+    }
+    if (ret != -ENOENT || std::chrono::steady_clock::now() >= deadline) {
+      std::cerr << "Multishot cancel failed (" << ret << ")\n";
+      return false;
+    }
+    std::this_thread::yield();
+  }
+}
+
 void io_service::submit(io_batch<io_service> &batch) {
-  m_io_queue->enqueue(batch.operations());
+  thread_state &state = setup_thread_context();
+  if (state.m_uring != nullptr) {
+    state.m_inflight += batch.operations().size();
+  }
+  state.m_io_queue->enqueue(batch.operations());
   submit();
 }
 
@@ -128,7 +759,11 @@ void io_service::submit(io_link<io_service> &io_link) {
                operations[i]);
   }
 
-  m_io_queue->enqueue(operations);
+  thread_state &state = setup_thread_context();
+  if (state.m_uring != nullptr) {
+    state.m_inflight += operations.size();
+  }
+  state.m_io_queue->enqueue(operations);
 
   submit();
 }
@@ -1,47 +1,294 @@
 #ifndef __IO_IO_SERVICE_HPP__
 #define __IO_IO_SERVICE_HPP__
 
+#include "coroutine/scheduler/pollable.hpp"
+#include "coroutine/scheduler/scheduler.hpp"
 #include "io_operations.hpp"
 #include "io_pipeline.hpp"
 #include "uring_data.hpp"
 
+#include <array>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <coroutine>
 #include <iostream>
 #include <liburing.h>
 #include <liburing/io_uring.h>
 #include <memory>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-class io_service : public io_operation<io_service> {
-  static thread_local unsigned int m_thread_id;
-  static thread_local uring_data::allocator *m_uio_data_allocator;
-  static thread_local io_op_pipeline *m_io_queue;
+/* SHARED     : One ring for all threads, completions are reaped by a dedicated
+ *              thread and scheduled back to the waiting coroutine. When a
+ *              scheduler is given its idle workers also reap the ring.
+ * PER_THREAD : Each worker of the attached scheduler lazily creates its own
+ *              ring, submits to it and reaps it from the scheduler loop, so the
+ *              completion is resumed on the thread that issued the io. Threads
+ *              outside the scheduler keep using the shared ring.
+ */
+enum class IO_RING_MODE { SHARED, PER_THREAD };
 
-  std::vector<io_op_pipeline *> m_io_queues;
+// Size of the registered file table of each ring, capped by RLIMIT_NOFILE.
+constexpr unsigned int FIXED_FILES = 4096;
+
+// Size of the registered buffer table of each ring.
+constexpr unsigned int FIXED_BUFFERS = 1024;
+
+/* Settings of the kernel SQ polling thread. With SQPOLL the kernel thread
+ * picks up new sqes by itself, submitting only publishes the SQ tail and the
+ * ring is entered just to wake the thread up after it went idle.
+ */
+struct sqpoll_config {
+  // Milliseconds without sqes before the SQ thread goes to sleep.
+  unsigned int sq_thread_idle = 1000;
+
+  // CPU the SQ thread is pinned to, -1 to let the kernel place it.
+  int sq_thread_cpu = -1;
+
+  io_uring_params params() const noexcept {
+    io_uring_params params{};
+    params.flags          = IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = sq_thread_idle;
+    if (sq_thread_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = sq_thread_cpu;
+    }
+    return params;
+  }
+};
+
+class io_service : public io_operation<io_service>, public pollable {
+  // What a thread keeps for one service, freed along with the service.
+  struct thread_state {
+    uring_data::allocator *m_uio_data_allocator = nullptr;
+    io_op_pipeline *m_io_queue                  = nullptr;
+
+    // Ring owned by the thread, null while it submits to the shared one.
+    io_uring *m_uring       = nullptr;
+    unsigned int m_inflight = 0;
+    bool m_wake_armed       = false;
+    eventfd_t m_wake_buffer = 0;
+    bool m_sq_full          = false;
+  };
+
+  /* States the calling thread looked up last. A slot is keyed by m_id, which
+   * unlike the address of a service is never reused, so the slot of a
+   * destroyed service is never matched again. A null state means the thread
+   * has none for that service yet.
+   */
+  struct thread_slot {
+    uint64_t m_service    = 0;
+    thread_state *m_state = nullptr;
+  };
+
+  static constexpr size_t THREAD_SLOTS = 4;
+
+  // How long cancel_stream() retries while the op has not reached the kernel.
+  static constexpr std::chrono::milliseconds STREAM_CANCEL_TIMEOUT{1000};
+
+  static thread_local std::array<thread_slot, THREAD_SLOTS> m_thread_slots;
+  static thread_local unsigned int m_thread_slot_next;
+  static std::atomic_uint64_t m_next_id;
+
+  const uint64_t m_id = m_next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+
+  // Guarded by m_thread_context_mutex.
+  std::unordered_map<std::thread::id, std::unique_ptr<thread_state>>
+      m_thread_states;
   std::vector<uring_data::allocator *> m_uio_data_allocators;
+  std::vector<io_uring *> m_thread_urings;
+  mutable std::mutex m_thread_context_mutex;
+
+  /* Registered file table, the same on every ring. Slots below
+   * m_fixed_managed are handed out by register_fd() and mirrored to each
+   * ring, the rest is left to the kernel for direct descriptors. Only
+   * registered once register_fd() or a direct op needs it, m_file_table is
+   * then set. Guarded by m_thread_context_mutex.
+   */
+  unsigned int m_fixed_files   = 0;
+  unsigned int m_fixed_managed = 0;
+  std::vector<int> m_fixed_fds;
+  std::vector<unsigned int> m_fixed_free;
+  std::atomic_bool m_file_table{false};
+
+  // Registered buffer table, mirrored to each ring like the file table and
+  // registered by the first register_buffer(). A free slot has a null
+  // iov_base.
+  std::vector<iovec> m_fixed_buffers;
+  std::vector<unsigned int> m_fixed_buffers_free;
+  bool m_buffer_table = false;
+
+  IO_RING_MODE m_mode    = IO_RING_MODE::SHARED;
+  scheduler *m_scheduler = nullptr;
+
+  // Pipelines with ops waiting to be submitted (lock free LIFO list).
+  std::atomic<io_op_pipeline *> m_ready_queues{nullptr};
+
+  /* Submit requests not yet served. The thread moving it from zero becomes
+   * the combiner and submits the ops of every thread until the count it
+   * consumed matches, so requests that race with it are never lost.
+   */
+  std::atomic_uint m_submit_requests{0};
+
+  // Set when the SQ was full, the CQ thread retries once completions free it.
+  std::atomic_bool m_sq_full{false};
 
-  std::atomic<io_op_pipeline *> m_io_queue_overflow{nullptr};
+  // Coroutines suspended in sq_space() with the scheduler to resume them on.
+  std::vector<std::pair<std::coroutine_handle<>, scheduler *>> m_sq_waiters;
+  std::mutex m_sq_waiters_mutex;
+
+  std::atomic_uint64_t m_sq_overflows{0};
+  std::atomic_uint64_t m_sq_rejections{0};
+  std::atomic_uint64_t m_sq_waits{0};
+
+  io_fail_fast<io_service> m_fail_fast{this};
 
   io_uring m_uring;
+  std::mutex m_cq_mutex;
 
   unsigned int m_entries;
   unsigned int m_flags;
 
+  bool m_sqpoll                 = false;
+  unsigned int m_sq_thread_cpu  = 0;
+  unsigned int m_sq_thread_idle = 0;
+  std::atomic_uint64_t m_sqpoll_wakeups{0};
+
   std::thread m_io_cq_thread;
-  std::atomic_bool m_io_sq_running{false};
-  std::atomic_int m_threads{0};
+  placement_config m_cq_placement;
 
   std::atomic_bool m_stop_requested{false};
 
 public:
-  io_service(const u_int &entries, const u_int &flags);
-  io_service(const u_int &entries, io_uring_params &params);
+  // cq_placement pins the CQ thread with PLACEMENT::CPUSET and names it.
+  io_service(const u_int &entries, const u_int &flags,
+             const placement_config &cq_placement = {});
+  io_service(const u_int &entries, io_uring_params &params,
+             const placement_config &cq_placement = {});
+  io_service(const u_int &entries, const sqpoll_config &config,
+             const placement_config &cq_placement = {});
+  io_service(const u_int &entries, const u_int &flags, scheduler &schd,
+             IO_RING_MODE mode = IO_RING_MODE::PER_THREAD,
+             const placement_config &cq_placement = {});
+  io_service(const u_int &entries, const sqpoll_config &config,
+             scheduler &schd, IO_RING_MODE mode = IO_RING_MODE::PER_THREAD,
+             const placement_config &cq_placement = {});
 
   ~io_service();
 
-  template <size_t n>
-  bool register_buffer(iovec (&io_vec)[n]) {
-    return io_uring_register_buffers(&m_uring, io_vec, n) == 0 ? true : false;
+  IO_RING_MODE mode() const noexcept { return m_mode; }
+
+  bool sqpoll() const noexcept { return m_sqpoll; }
+
+  // Number of submissions that had to wake the SQ thread up.
+  uint64_t sqpoll_wakeups() const noexcept {
+    return m_sqpoll_wakeups.load(std::memory_order_relaxed);
+  }
+
+  // Number of times ops were held back because the SQ was full.
+  uint64_t sq_overflows() const noexcept {
+    return m_sq_overflows.load(std::memory_order_relaxed);
+  }
+
+  // Number of fail_fast() ops completed with -EBUSY.
+  uint64_t sq_rejections() const noexcept {
+    return m_sq_rejections.load(std::memory_order_relaxed);
+  }
+
+  // Number of times a coroutine was suspended by sq_space().
+  uint64_t sq_waits() const noexcept {
+    return m_sq_waits.load(std::memory_order_relaxed);
+  }
+
+  // Check ops submitted from the calling thread are held back by a full SQ.
+  bool sq_full() const noexcept {
+    thread_state *state = find_thread_state();
+    return state != nullptr && state->m_uring != nullptr
+               ? state->m_sq_full
+               : m_sq_full.load(std::memory_order_relaxed);
+  }
+
+  class sq_space_awaiter {
+    io_service *m_io_service;
+    scheduler *m_scheduler = nullptr;
+
+  public:
+    explicit sq_space_awaiter(io_service *service) : m_io_service{service} {}
+
+    bool await_ready() const noexcept { return !m_io_service->sq_full(); }
+
+    auto await_suspend(const std::coroutine_handle<> &handle) noexcept
+        -> std::coroutine_handle<> {
+      return m_io_service->wait_sq_space(handle, m_scheduler);
+    }
+
+    void await_resume() const noexcept {}
+
+    void via(scheduler *s) { m_scheduler = s; }
+  };
+
+  /* Suspend the caller while the SQ is full, it is resumed once the held back
+   * ops were handed to the kernel. Ops submitted without it are never lost,
+   * they just queue up behind the held back ones.
+   */
+  auto sq_space() { return sq_space_awaiter(this); }
+
+  // Ops issued through it fail with -EBUSY instead of waiting for SQ space.
+  io_fail_fast<io_service> &fail_fast() noexcept { return m_fail_fast; }
+
+  unsigned int poll() noexcept override;
+
+  bool pending() const noexcept override;
+
+  bool wait(int wake_fd,
+            const std::chrono::nanoseconds &timeout) noexcept override;
+
+  /* Put buffer in a slot of the registered buffer table of every ring and
+   * return the buf_index for read_fixed and write_fixed, or -errno. The
+   * memory stays pinned until unregister_buffer(). buffer_arena hands out
+   * pieces of registered regions without managing indices by hand.
+   */
+  int register_buffer(const iovec &buffer);
+
+  // Release a slot, ops still in flight keep the buffer pinned.
+  bool unregister_buffer(int index);
+
+  /* Put fd in a slot of the registered file table of every ring. Ops given
+   * the returned fixed_fd skip the fd lookup, and on kernels without
+   * IORING_FEAT_SQPOLL_NONFIXED they are the only ones SQPOLL accepts. The
+   * table holds its own reference, fd may be closed once registered. On
+   * failure the index is -errno.
+   */
+  fixed_fd register_fd(int fd);
+
+  // Release a slot from register_fd(), ops still in flight keep the file.
+  bool unregister_fd(fixed_fd &fd);
+
+  // Number of slots of the table, 0 once the kernel refused to register it.
+  unsigned int fixed_files() const noexcept {
+    std::unique_lock lk(m_thread_context_mutex);
+    return m_fixed_files;
+  }
+
+  /* Register the file table on every ring unless done already, returns 0 or
+   * -errno. register_fd() and direct ops call it on first use.
+   */
+  int enable_file_table();
+
+  // Check ops submitted from the calling thread can use fd.
+  bool fixed_usable(const fixed_fd &fd) {
+    return fd.m_uring == nullptr || fd.m_uring == submission_ring();
+  }
+
+  // Ring the ops of the calling thread are submitted to.
+  io_uring *submission_ring() {
+    thread_state &state = setup_thread_context();
+    return state.m_uring != nullptr ? state.m_uring : &m_uring;
   }
 
   auto batch() { return io_batch<io_service>(this); }
@@ -49,8 +296,7 @@ public:
   auto link() { return io_link<io_service>(this); }
 
   uring_data::allocator *get_awaiter_allocator() {
-    setup_thread_context();
-    return m_uio_data_allocator;
+    return setup_thread_context().m_uio_data_allocator;
   }
 
   void submit(io_batch<io_service> &batch);
@@ -60,11 +306,32 @@ public:
   template <IO_URING_OP OP>
   auto submit_io(OP &&operation) -> uring_awaiter {
 
-    setup_thread_context();
+    thread_state &state = setup_thread_context();
+
+    auto future = operation.get_future(state.m_uio_data_allocator);
 
-    auto future = operation.get_future(m_uio_data_allocator);
+    if (state.m_uring != nullptr) {
+      // The ring is owned by this thread, prepare the sqe right away and let
+      // the next poll() submit it.
+      ++state.m_inflight;
+      if (state.m_io_queue->empty()) [[likely]] {
+        if (operation.run(state.m_uring)) [[likely]] {
+          return future;
+        }
+        // SQ is full, hand the prepared sqes to the kernel to make room.
+        submit_uring(state.m_uring);
+        if (operation.run(state.m_uring)) {
+          return future;
+        }
+        state.m_sq_full = true;
+        m_sq_overflows.fetch_add(1, std::memory_order_relaxed);
+      }
+      // Hold the op back behind the others, poll() moves them in order.
+      state.m_io_queue->enqueue(std::forward<OP>(operation));
+      return future;
+    }
 
-    m_io_queue->enqueue(std::forward<OP>(operation));
+    state.m_io_queue->enqueue(std::forward<OP>(operation));
 
     if (!(operation.m_sqe_flags & (IOSQE_IO_HARDLINK | IOSQE_IO_LINK))) {
       submit();
@@ -73,18 +340,134 @@ public:
     return future;
   }
 
+  template <IO_URING_OP OP>
+  auto try_submit_io(OP &&operation) -> uring_awaiter {
+
+    setup_thread_context();
+
+    if (!sq_full()) [[likely]] {
+      return submit_io(std::forward<OP>(operation));
+    }
+
+    m_sq_rejections.fetch_add(1, std::memory_order_relaxed);
+    return complete_now(std::forward<OP>(operation), -EBUSY);
+  }
+
+  // Complete the op with result without handing it to the kernel.
+  template <IO_URING_OP OP>
+  auto complete_now(OP &&operation, int result) -> uring_awaiter {
+
+    auto future =
+        operation.get_future(setup_thread_context().m_uio_data_allocator);
+    future.get_data()->complete(result);
+    return future;
+  }
+
+  template <IO_URING_OP OP>
+  auto submit_stream(OP &&operation) -> io_stream<io_service> {
+
+    setup_thread_context();
+
+    auto stream     = new uring_stream;
+    stream->m_uring = submission_ring();
+    operation.m_stream = stream;
+    submit_io(std::forward<OP>(operation));
+    return io_stream<io_service>(this, stream);
+  }
+
+  // Synchronously cancel a multishot op, from any thread.
+  bool cancel_stream(uring_stream &stream) noexcept;
+
   unsigned int get_buffer_index(unsigned int &flag) { return flag >> 16; }
 
 protected:
   void submit();
 
+  // Hand the listed pipelines to the shared ring, one caller at a time.
+  void submit_pipelines() noexcept;
+
+  // Move the ops held back by the calling thread into its ring and submit.
+  void flush_thread_ring(thread_state &state) noexcept;
+
   void io_loop() noexcept;
 
-  bool io_queue_empty() const noexcept;
+  void queue_pipeline(io_op_pipeline *queue) noexcept;
+
+  void drain_pipelines() noexcept;
+
+  auto wait_sq_space(const std::coroutine_handle<> &handle,
+                     scheduler *schd) noexcept -> std::coroutine_handle<>;
+
+  void wake_sq_waiters() noexcept;
+
+  // State of the calling thread, null if it has not used the service yet.
+  thread_state *find_thread_state() const noexcept {
+    for (auto &slot : m_thread_slots) {
+      if (slot.m_service == m_id) [[likely]] {
+        return slot.m_state;
+      }
+    }
+    return lookup_thread_state();
+  }
+
+  thread_state *lookup_thread_state() const noexcept;
+
+  void cache_thread_state(thread_state *state) const noexcept;
+
+  // State of the calling thread, created on first use.
+  thread_state &setup_thread_context() {
+    thread_state *state = find_thread_state();
+    return state != nullptr ? *state : create_thread_state();
+  }
+
+  thread_state &create_thread_state();
+
+  io_uring *setup_thread_uring();
+
+  int register_file_table(io_uring *uring);
+
+  int register_file_tables();
+
+  int register_buffer_tables();
+
+  void init_uring(io_uring_params &params);
+
+  void submit_uring(io_uring *const uring) noexcept;
+
+  /* Handles made ready by one reap, scheduled in bulk as long as consecutive
+   * completions resume on the same scheduler and lane.
+   */
+  struct ready_batch {
+    static constexpr size_t SIZE = 256;
+
+    std::array<std::coroutine_handle<>, SIZE> m_handles;
+    size_t m_count         = 0;
+    scheduler *m_scheduler = nullptr;
+    PRIORITY m_priority    = PRIORITY::NORMAL;
+
+    void add(scheduler *schd, PRIORITY priority,
+             const std::coroutine_handle<> &handle) noexcept {
+      if (schd != m_scheduler || priority != m_priority || m_count == SIZE) {
+        flush();
+        m_scheduler = schd;
+        m_priority  = priority;
+      }
+      m_handles[m_count++] = handle;
+    }
+
+    void flush() noexcept {
+      if (m_count != 0) {
+        m_scheduler->schedule_bulk({m_handles.data(), m_count}, m_priority);
+        m_count = 0;
+      }
+    }
+  };
 
-  void setup_thread_context();
+  // state is the one of the thread owning uring, null for the shared ring.
+  unsigned int reap_completions(io_uring *uring,
+                                thread_state *state = nullptr) noexcept;
 
-  void handle_completion(io_uring_cqe *cqe);
+  void handle_completion(io_uring_cqe *cqe, ready_batch &ready);
 };
 
 #endif
\ No newline at end of file
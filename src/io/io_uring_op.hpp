@@ -13,6 +13,21 @@ concept IO_URING_OP = requires(T a, io_uring *const uring,
   { a.get_future(alloc) } -> std::same_as<uring_awaiter>;
 };
 
+/* Slot of a registered file. Ops given a fixed_fd pass the slot with
+ * IOSQE_FIXED_FILE, so the kernel skips the fd lookup and refcounting.
+ * Slots from io_service::register_fd() are valid on every ring, direct
+ * descriptors (accept_direct, openat_direct) only on the ring that made them.
+ */
+struct fixed_fd {
+  int m_index       = -1;
+  io_uring *m_uring = nullptr;
+
+  // Slot in the file table, or -errno if no descriptor was created.
+  int index() const noexcept { return m_index; }
+
+  operator bool() const noexcept { return m_index >= 0; }
+};
+
 struct io_uring_future {
   uring_data *m_data;
 
@@ -118,6 +133,37 @@ struct io_uring_op_openat_t : public io_uring_future {
   }
 };
 
+struct io_uring_op_openat_direct_t : public io_uring_future {
+  int m_dir;
+  const char *m_filename;
+  int m_flags;
+  mode_t m_mode;
+  unsigned char m_sqe_flags;
+
+  io_uring_op_openat_direct_t() = default;
+
+  io_uring_op_openat_direct_t(const int &dir, const char *const &filename,
+                              const int &flags, const mode_t &mode,
+                              unsigned char &sqe_flags)
+      : m_dir{dir}
+      , m_filename{filename}
+      , m_flags{flags}
+      , m_mode{mode}
+      , m_sqe_flags{sqe_flags} {}
+
+  bool run(io_uring *const uring) {
+    io_uring_sqe *sqe;
+    if ((sqe = io_uring_get_sqe(uring)) == nullptr) {
+      return false;
+    }
+    io_uring_prep_openat_direct(sqe, m_dir, m_filename, m_flags, m_mode,
+                                IORING_FILE_INDEX_ALLOC);
+    sqe->flags |= m_sqe_flags;
+    io_uring_sqe_set_data(sqe, m_data);
+    return true;
+  }
+};
+
 struct io_uring_op_read_t : public io_uring_future {
   int m_fd;
   void *m_buffer;
@@ -467,6 +513,89 @@ struct io_uring_op_accept_t : public io_uring_future {
   }
 };
 
+struct io_uring_op_accept_direct_t : public io_uring_future {
+  int m_fd;
+  int m_flags;
+  unsigned char m_sqe_flags;
+
+  io_uring_op_accept_direct_t() = default;
+
+  io_uring_op_accept_direct_t(const int &fd, const int &flags,
+                              unsigned char &sqe_flags)
+      : m_fd{fd}, m_flags{flags}, m_sqe_flags{sqe_flags} {}
+
+  bool run(io_uring *const uring) {
+    io_uring_sqe *sqe;
+    if ((sqe = io_uring_get_sqe(uring)) == nullptr) {
+      return false;
+    }
+    io_uring_prep_accept_direct(sqe, m_fd, nullptr, nullptr, m_flags,
+                                IORING_FILE_INDEX_ALLOC);
+    sqe->flags |= m_sqe_flags;
+    io_uring_sqe_set_data(sqe, m_data);
+    return true;
+  }
+};
+
+struct io_uring_stream_future : public io_uring_future {
+  uring_stream *m_stream = nullptr;
+
+  uring_awaiter get_future(uring_data::allocator *allocator) {
+    uring_awaiter awaiter = io_uring_future::get_future(allocator);
+    m_data->m_stream      = m_stream;
+    m_stream->m_data      = m_data;
+    return awaiter;
+  }
+};
+
+struct io_uring_op_accept_multishot_t : public io_uring_stream_future {
+  int m_fd;
+  int m_flags;
+  unsigned char m_sqe_flags;
+
+  io_uring_op_accept_multishot_t() = default;
+
+  io_uring_op_accept_multishot_t(const int &fd, const int &flags,
+                                 unsigned char &sqe_flags)
+      : m_fd{fd}, m_flags{flags}, m_sqe_flags{sqe_flags} {}
+
+  bool run(io_uring *const uring) {
+    io_uring_sqe *sqe;
+    if ((sqe = io_uring_get_sqe(uring)) == nullptr) {
+      return false;
+    }
+    io_uring_prep_multishot_accept(sqe, m_fd, nullptr, nullptr, m_flags);
+    sqe->flags |= m_sqe_flags;
+    io_uring_sqe_set_data(sqe, m_data);
+    return true;
+  }
+};
+
+struct io_uring_op_recv_multishot_t : public io_uring_stream_future {
+  int m_fd;
+  int m_gbid;
+  int m_flags;
+  unsigned char m_sqe_flags;
+
+  io_uring_op_recv_multishot_t() = default;
+
+  io_uring_op_recv_multishot_t(const int &fd, const int &gbid,
+                               const int &flags, unsigned char &sqe_flags)
+      : m_fd{fd}, m_gbid{gbid}, m_flags{flags}, m_sqe_flags{sqe_flags} {}
+
+  bool run(io_uring *const uring) {
+    io_uring_sqe *sqe;
+    if ((sqe = io_uring_get_sqe(uring)) == nullptr) {
+      return false;
+    }
+    io_uring_prep_recv_multishot(sqe, m_fd, nullptr, 0, m_flags);
+    io_uring_sqe_set_flags(sqe, m_sqe_flags | IOSQE_BUFFER_SELECT);
+    sqe->buf_group = m_gbid;
+    io_uring_sqe_set_data(sqe, m_data);
+    return true;
+  }
+};
+
 struct io_uring_op_send_t : public io_uring_future {
   int m_fd;
   void *m_buffer;
@@ -517,6 +646,28 @@ struct io_uring_op_close_t : public io_uring_future {
   }
 };
 
+struct io_uring_op_close_direct_t : public io_uring_future {
+  unsigned int m_index;
+  unsigned char m_sqe_flags;
+
+  io_uring_op_close_direct_t() = default;
+
+  io_uring_op_close_direct_t(const unsigned int &index,
+                             unsigned char &sqe_flags)
+      : m_index{index}, m_sqe_flags{sqe_flags} {}
+
+  bool run(io_uring *const uring) {
+    io_uring_sqe *sqe;
+    if ((sqe = io_uring_get_sqe(uring)) == nullptr) {
+      return false;
+    }
+    io_uring_prep_close_direct(sqe, m_index);
+    sqe->flags |= m_sqe_flags;
+    io_uring_sqe_set_data(sqe, m_data);
+    return true;
+  }
+};
+
 struct io_uring_op_statx_t : public io_uring_future {
   int m_dfd;
   const char *m_path;
@@ -590,6 +741,9 @@ using io_uring_op =
                  io_uring_op_nop_t, io_uring_op_send_t,
                  io_uring_op_recv_provide_buffer_t, io_uring_op_poll_add_t,
                  io_uring_op_provide_buffer_t, io_uring_op_read_fixed_t,
-                 io_uring_op_readv_t, io_uring_op_link_timeout_t>;
+                 io_uring_op_readv_t, io_uring_op_link_timeout_t,
+                 io_uring_op_accept_multishot_t, io_uring_op_recv_multishot_t,
+                 io_uring_op_accept_direct_t, io_uring_op_openat_direct_t,
+                 io_uring_op_close_direct_t>;
 
 #endif
\ No newline at end of file
@@ -6,20 +6,36 @@
 
 #include <atomic>
 #include <coroutine>
+#include <deque>
 #include <liburing.h>
+#include <mutex>
+#include <utility>
+
+class uring_stream;
 
 struct uring_data {
   using allocator = pool_allocator<uring_data, 128>;
 
   scheduler *m_scheduler = nullptr;
   allocator *m_allocator = nullptr;
+  PRIORITY m_priority    = PRIORITY::NORMAL;
   std::coroutine_handle<> m_handle;
   int m_result         = 0;
   unsigned int m_flags = 0;
   std::atomic_bool m_handle_ctl{false};
   std::atomic_bool m_destroy_ctl{false};
 
+  // Set for multishot ops, their cqes are queued on the stream instead.
+  uring_stream *m_stream = nullptr;
+
   void destroy() { m_allocator->deallocate(this); }
+
+  // Complete without going through the ring, the awaiter resumes right away.
+  void complete(int result) noexcept {
+    m_result = result;
+    m_destroy_ctl.store(true, std::memory_order_relaxed);
+    m_handle_ctl.store(true, std::memory_order_release);
+  }
 };
 
 class uring_awaiter {
@@ -55,7 +71,7 @@ public:
         m_data->m_handle = handle;
         auto schd        = m_data->m_scheduler;
         if (m_data->m_handle_ctl.exchange(true, std::memory_order_acq_rel)) {
-          return handle;
+          return schd->transfer_to(handle);
         }
         return schd->get_next_coroutine();
       }
@@ -88,7 +104,108 @@ public:
 
   uring_data *get_data() const noexcept { return m_data; }
 
-  void via(scheduler *s) { this->m_data->m_scheduler = s; }
+  // Resume on the lane of the coroutine issuing the op.
+  void via(scheduler *s) {
+    this->m_data->m_scheduler = s;
+    this->m_data->m_priority  = s->current_priority();
+  }
+};
+
+/* Completions of a multishot op. Its sqe keeps posting cqes flagged with
+ * IORING_CQE_F_MORE, the last one comes without it. The stream is shared by
+ * the consumer and the ring, whichever lets go last frees it.
+ */
+class uring_stream {
+  std::mutex m_mutex;
+  std::deque<std::pair<int, unsigned int>> m_results;
+  std::coroutine_handle<> m_handle;
+  scheduler *m_scheduler = nullptr;
+  PRIORITY m_priority    = PRIORITY::NORMAL;
+  bool m_done            = false;
+  std::atomic_uint m_refs{2};
+  std::atomic_bool m_orphaned{false};
+
+public:
+  uring_data *m_data = nullptr;
+
+  // Ring the sqe went to, a cancel has to target the same ring.
+  io_uring *m_uring = nullptr;
+
+  void push(int result, unsigned int flags) noexcept {
+    bool last = !(flags & IORING_CQE_F_MORE);
+    std::coroutine_handle<> handle;
+    scheduler *schd;
+    PRIORITY priority;
+    {
+      std::unique_lock lk(m_mutex);
+      m_results.emplace_back(result, flags);
+      m_done   = last;
+      handle   = std::exchange(m_handle, nullptr);
+      schd     = m_scheduler;
+      priority = m_priority;
+    }
+    if (handle) {
+      schd->schedule(handle, priority);
+    }
+    if (last) {
+      release();
+    }
+  }
+
+  // Park the consumer until the next cqe, false if one is already queued.
+  bool suspend(const std::coroutine_handle<> &handle,
+               scheduler *schd) noexcept {
+    std::unique_lock lk(m_mutex);
+    if (!m_results.empty()) {
+      return false;
+    }
+    m_handle    = handle;
+    m_scheduler = schd;
+    m_priority  = schd->current_priority();
+    return true;
+  }
+
+  bool ready() noexcept {
+    std::unique_lock lk(m_mutex);
+    return !m_results.empty();
+  }
+
+  std::pair<int, unsigned int> pop() noexcept {
+    std::unique_lock lk(m_mutex);
+    auto result = m_results.front();
+    m_results.pop_front();
+    return result;
+  }
+
+  // The last cqe arrived, the op is no longer in the kernel.
+  bool finished() noexcept {
+    std::unique_lock lk(m_mutex);
+    return m_done;
+  }
+
+  // Finished and every result was consumed.
+  bool done() noexcept {
+    std::unique_lock lk(m_mutex);
+    return m_done && m_results.empty();
+  }
+
+  /* The consumer let go of an op a cancel did not find, it is cancelled once
+   * a cqe shows it armed.
+   */
+  void orphan() noexcept { m_orphaned.store(true, std::memory_order_release); }
+
+  // True once per orphan(), the caller cancels the op.
+  bool take_orphan() noexcept {
+    return m_orphaned.load(std::memory_order_acquire) &&
+           m_orphaned.exchange(false, std::memory_order_acq_rel);
+  }
+
+  void release() noexcept {
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      m_data->destroy();
+      delete this;
+    }
+  }
 };
 
 #endif
\ No newline at end of file
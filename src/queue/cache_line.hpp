@@ -0,0 +1,25 @@
+#ifndef __QUEUE_CACHE_LINE_HPP__
+#define __QUEUE_CACHE_LINE_HPP__
+
+#include <cstddef>
+#include <new>
+
+/* Alignment keeping atomics written by different threads off each other's
+ * cache line. It is part of the layout of the queues and of thread_context,
+ * so the library and its users have to be built with the same -mtune.
+ */
+#ifdef __cpp_lib_hardware_interference_size
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winterference-size"
+#endif
+inline constexpr size_t CACHE_LINE_SIZE =
+    std::hardware_destructive_interference_size;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+inline constexpr size_t CACHE_LINE_SIZE = 64;
+#endif
+
+#endif
@@ -2,32 +2,52 @@
 #define __QUEUE_CIRCULAR_ARRAY_HPP__
 
 #include <atomic>
-
-template <typename T>
+#include <type_traits>
+#include <utility>
+
+/* Ring of items indexed modulo capacity. Atomic slots are needed where a
+ * thief may read a slot the owner is writing. A single consumer only reads
+ * slots the producer published through its back index and can use plain
+ * ones, which also keeps items too large for a lock free atomic off
+ * libatomic.
+ */
+template <typename T, bool Atomic = true>
 class circular_array {
+  using slot = std::conditional_t<Atomic, std::atomic<T>, T>;
+
   size_t m_capacity;
   size_t m_mask;
-  std::atomic<T> *m_data = nullptr;
+  slot *m_data = nullptr;
 
 public:
   explicit circular_array(size_t capacity)
       : m_capacity{capacity}
       , m_mask{m_capacity - 1}
-      , m_data{new std::atomic<T>[m_capacity]} {}
+      , m_data{new slot[m_capacity]} {}
 
   ~circular_array() { delete[] m_data; }
 
   template <typename D>
   void push(size_t i, D &&data) noexcept {
-    m_data[i & m_mask].store(std::forward<D>(data), std::memory_order_relaxed);
+    if constexpr (Atomic) {
+      m_data[i & m_mask].store(std::forward<D>(data),
+                               std::memory_order_relaxed);
+    } else {
+      m_data[i & m_mask] = std::forward<D>(data);
+    }
   }
 
   T pop(size_t i) const noexcept {
-    return m_data[i & m_mask].load(std::memory_order_relaxed);
+    if constexpr (Atomic) {
+      return m_data[i & m_mask].load(std::memory_order_relaxed);
+    } else {
+      return m_data[i & m_mask];
+    }
   }
 
-  circular_array *resize(size_t back, size_t front) {
-    circular_array *ptr = new circular_array(2 * m_capacity);
+  // Copy of [front, back) in a new array of capacity items.
+  circular_array *resize(size_t back, size_t front, size_t capacity) {
+    circular_array *ptr = new circular_array(capacity);
     for (size_t i = front; i != back; ++i) {
       ptr->push(i, pop(i));
     }
@@ -37,4 +57,4 @@ public:
   size_t size() const noexcept { return m_capacity; }
 };
 
-#endif
\ No newline at end of file
+#endif
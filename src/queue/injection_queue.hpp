@@ -0,0 +1,105 @@
+#ifndef __QUEUE_INJECTION_QUEUE_HPP__
+#define __QUEUE_INJECTION_QUEUE_HPP__
+
+#include "cache_line.hpp"
+#include "pool_allocator.hpp"
+
+#include <atomic>
+
+/* A lock free multi producer multi consumer queue that is only ever emptied
+ * as a whole. Producers push onto an intrusive stack with a CAS, a consumer
+ * takes the entire stack with a single exchange and walks it oldest first.
+ * As no consumer pops a single node there is no ABA problem.
+ */
+
+template <typename T>
+class injection_queue {
+  struct node {
+    T m_item;
+    node *m_next;
+  };
+
+  // Queues of the lanes sit next to each other in the scheduler.
+  alignas(CACHE_LINE_SIZE) std::atomic<node *> m_head{nullptr};
+  pool_allocator<node, 256> m_allocator;
+
+public:
+  injection_queue() = default;
+
+  injection_queue(const injection_queue &) = delete;
+  injection_queue &operator=(const injection_queue &) = delete;
+
+  ~injection_queue() {
+    pop_all([](T &) {});
+  }
+
+  bool empty() const noexcept {
+    return m_head.load(std::memory_order_relaxed) == nullptr;
+  }
+
+  void push(const T &item) {
+    node *n     = m_allocator.allocate();
+    n->m_item   = item;
+    n->m_next   = m_head.load(std::memory_order_relaxed);
+    while (!m_head.compare_exchange_weak(n->m_next, n,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+  }
+
+  // Push [first, last) with a single publication, keeping their order.
+  template <typename Iterator>
+  void push(Iterator first, Iterator last) {
+    if (first == last) {
+      return;
+    }
+    node *newest = nullptr;
+    node *oldest = nullptr;
+    for (; first != last; ++first) {
+      node *n   = m_allocator.allocate();
+      n->m_item = *first;
+      n->m_next = newest;
+      newest    = n;
+      if (oldest == nullptr) {
+        oldest = n;
+      }
+    }
+    oldest->m_next = m_head.load(std::memory_order_relaxed);
+    while (!m_head.compare_exchange_weak(oldest->m_next, newest,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+  }
+
+  /* Take every queued item and hand them to consumer in push order. Returns
+   * the number of items taken.
+   */
+  template <typename Consumer>
+  size_t pop_all(Consumer &&consumer) {
+    if (empty()) {
+      return 0;
+    }
+    node *head = m_head.exchange(nullptr, std::memory_order_acquire);
+
+    // The stack is newest first, reverse it.
+    node *oldest = nullptr;
+    while (head != nullptr) {
+      node *next   = head->m_next;
+      head->m_next = oldest;
+      oldest       = head;
+      head         = next;
+    }
+
+    size_t count = 0;
+    while (oldest != nullptr) {
+      node *next = oldest->m_next;
+      consumer(oldest->m_item);
+      m_allocator.deallocate(oldest);
+      oldest = next;
+      ++count;
+    }
+    return count;
+  }
+};
+
+#endif
@@ -1,42 +1,62 @@
 #ifndef __QUEUE_SHARED_WORK_QUEUE_HPP__
 #define __QUEUE_SHARED_WORK_QUEUE_HPP__
 
+#include "cache_line.hpp"
 #include "circular_array.hpp"
 
 #include <atomic>
+#include <vector>
 
 /* A first in first out lock free data structure
  */
 
 template <typename T>
 class io_work_queue {
+  // One consumer at a time reads slots published by m_back, see
+  // circular_array.
+  using array = circular_array<T, false>;
 
-  // Front of the queue
-  std::atomic<size_t> m_front;
+  // Front of the queue, written by the consumer
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_front;
 
-  // Back of the queue
-  std::atomic<size_t> m_back;
+  /* Buffer the consumer is reading from, published before it is used. The
+   * producer keeps every replaced buffer until the consumer moved off it.
+   */
+  std::atomic<array *> m_hazard{nullptr};
+
+  // Back of the queue, written by the producer on a line of its own
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_back;
 
   // Current buffer used for storing data
-  std::atomic<circular_array<T> *> m_data{nullptr};
+  std::atomic<array *> m_data{nullptr};
 
-  /* Old buffer that was used for store data.
-   * Keep the old one just in-case some thread is dequeuing when new buffer is
-   * being created.
-   */
-  std::atomic<circular_array<T> *> m_old{nullptr};
+  // Producer only, buffers replaced by a resize.
+  std::vector<array *> m_retired;
+
+  // Initial capacity, an idle queue shrinks back toward it.
+  size_t m_capacity;
+  bool m_shrink;
+  unsigned int m_idle = 0;
+
+  // Enqueues onto an empty queue since the last resize before the buffer is
+  // halved.
+  static constexpr unsigned int SHRINK_AFTER = 64;
 
 public:
   // Create a io_work_queue with size capacity (capacity should be power of 2)
-  explicit io_work_queue(size_t capacity) {
+  explicit io_work_queue(size_t capacity, bool shrink = true)
+      : m_capacity{capacity}
+      , m_shrink{shrink} {
     m_front.store(0, std::memory_order_relaxed);
     m_back.store(0, std::memory_order_relaxed);
-    m_data.store(new circular_array<T>(capacity), std::memory_order_relaxed);
+    m_data.store(new array(capacity), std::memory_order_relaxed);
   }
 
   ~io_work_queue() {
     delete m_data.load(std::memory_order_relaxed);
-    delete m_old.load(std::memory_order_relaxed);
+    for (auto *data : m_retired) {
+      delete data;
+    }
   }
 
   // Check the io_work_queue is empty.
@@ -50,9 +70,14 @@ public:
    * to next power of 2
    */
   void enqueue(T &&item) {
-    size_t back             = m_back.load(std::memory_order_relaxed);
-    size_t front            = m_front.load(std::memory_order_acquire);
-    circular_array<T> *data = m_data.load(std::memory_order_relaxed);
+    size_t back  = m_back.load(std::memory_order_relaxed);
+    size_t front = m_front.load(std::memory_order_acquire);
+    array *data  = m_data.load(std::memory_order_relaxed);
+
+    if (back == front &&
+        (data->size() > m_capacity || !m_retired.empty())) [[unlikely]] {
+      data = idle(data, back, front);
+    }
 
     // Check the queue is full and resize the array.
     if (data->size() - 1 < static_cast<size_t>(back - front)) [[unlikely]] {
@@ -60,10 +85,10 @@ public:
         size_t a  = 0;
         auto size = (back + ((a - 1) - front)) + 1;
         if (data->size() - 1 < size) {
-          data = resize(data, back, front);
+          data = resize(data, back, front, 2 * data->size());
         }
       } else {
-        data = resize(data, back, front);
+        data = resize(data, back, front, 2 * data->size());
       }
     }
 
@@ -75,22 +100,23 @@ public:
    * to next power of 2
    */
   void bulk_enqueue(std::vector<T> &items) {
-    size_t items_count      = items.size();
-    size_t back             = m_back.load(std::memory_order_relaxed);
-    size_t front            = m_front.load(std::memory_order_acquire);
-    circular_array<T> *data = m_data.load(std::memory_order_relaxed);
+    size_t items_count = items.size();
+    size_t back        = m_back.load(std::memory_order_relaxed);
+    size_t front       = m_front.load(std::memory_order_acquire);
+    array *data        = m_data.load(std::memory_order_relaxed);
+
+    if (back == front &&
+        (data->size() > m_capacity || !m_retired.empty())) [[unlikely]] {
+      data = idle(data, back, front);
+    }
 
-    if ((data->size() - 1 - items_count) < static_cast<size_t>(back - front))
-        [[unlikely]] {
-      if (back < front) {
-        size_t a  = 0;
-        auto size = (back + ((a - 1) - front)) + 1;
-        if ((data->size() - 1 - items_count) < size) {
-          data = resize(data, back, front);
-        }
-      } else {
-        data = resize(data, back, front);
-      }
+    // A batch may need more than one doubling.
+    size_t capacity = data->size();
+    while (capacity - 1 < static_cast<size_t>(back - front) + items_count) {
+      capacity *= 2;
+    }
+    if (capacity != data->size()) [[unlikely]] {
+      data = resize(data, back, front, capacity);
     }
     for (size_t i = 0; i < items_count; ++i) {
       data->push(back + i, items[i]);
@@ -102,28 +128,62 @@ public:
    */
   bool dequeue(T &item) {
 
-    size_t back  = m_back.load(std::memory_order_relaxed);
+    size_t back  = m_back.load(std::memory_order_acquire);
     size_t front = m_front.load(std::memory_order_relaxed);
 
     if (back == front) {
       return false;
     }
 
-    circular_array<T> *data = m_data.load(std::memory_order_consume);
-    item                    = data->pop(front);
-    m_front.store(m_front + 1, std::memory_order_seq_cst);
+    array *data = protect();
+    item        = data->pop(front);
+    m_front.store(front + 1, std::memory_order_seq_cst);
     return true;
   }
 
 protected:
-  circular_array<T> *resize(circular_array<T> *data, size_t back,
-                            size_t front) {
-    circular_array<T> *new_data = data->resize(back, front);
-    delete m_old.load(std::memory_order_relaxed);
-    m_old.store(data, std::memory_order_relaxed);
-    m_data.store(new_data, std::memory_order_relaxed);
+  // Load m_data for the consumer, publishing it in m_hazard first.
+  array *protect() noexcept {
+    array *data = m_data.load(std::memory_order_acquire);
+    while (data != m_hazard.load(std::memory_order_relaxed)) {
+      m_hazard.store(data, std::memory_order_seq_cst);
+      data = m_data.load(std::memory_order_seq_cst);
+    }
+    return data;
+  }
+
+  array *resize(array *data, size_t back, size_t front, size_t capacity) {
+    array *new_data = data->resize(back, front, capacity);
+    m_data.store(new_data, std::memory_order_seq_cst);
+    m_retired.push_back(data);
+    m_idle = 0;
+    reclaim();
     return new_data;
   }
+
+  /* A consumer that published a buffer in m_hazard and then still found it
+   * in m_data reads it until it publishes another one, every other retired
+   * buffer can go.
+   */
+  void reclaim() {
+    array *hazard = m_hazard.load(std::memory_order_seq_cst);
+    std::erase_if(m_retired, [&](array *data) {
+      if (data == hazard) {
+        return false;
+      }
+      delete data;
+      return true;
+    });
+  }
+
+  // The producer found the queue empty, halve a buffer grown by a burst.
+  array *idle(array *data, size_t back, size_t front) {
+    reclaim();
+    if (!m_shrink || data->size() <= m_capacity || ++m_idle < SHRINK_AFTER) {
+      return data;
+    }
+    return resize(data, back, front, data->size() / 2);
+  }
 };
 
 #endif
\ No newline at end of file
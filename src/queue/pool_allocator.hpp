@@ -1,8 +1,10 @@
 #ifndef __UTILS_FIFO_ALLOCATOR_HPP__
 #define __UTILS_FIFO_ALLOCATOR_HPP__
 
-#include <atomic>
-#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
 #include <vector>
 
 template <unsigned int size>
@@ -11,92 +13,217 @@ union chunk_item {
   chunk_item *m_next = nullptr;
 };
 
-template <typename T, unsigned int block_size>
+/* Fixed size object pool with per thread magazines.
+ *
+ * Every thread keeps two magazines of up to magazine_size free chunks for
+ * each allocator it touches, and allocates from and frees into them without
+ * any atomic. A thread that runs out takes a full magazine from the shared
+ * depot, one that has two full ones hands one back, so a chunk freed on
+ * another thread, a uring_data completed on the CQ thread, comes back to the
+ * allocating threads a whole magazine at a time under a single lock. The
+ * depot grows by a block of block_size chunks under the same lock.
+ */
+template <typename T, unsigned int block_size, unsigned int magazine_size = 32>
 class pool_allocator {
+  static_assert(block_size % magazine_size == 0);
+
   using chunk = chunk_item<sizeof(T)>;
-  struct block_ptr {
-    chunk *m_ptr       = nullptr;
-    unsigned int m_tag = 0;
+
+  struct magazine {
+    chunk *m_head       = nullptr;
+    unsigned int m_size = 0;
+
+    chunk *pop() noexcept {
+      chunk *item = m_head;
+      m_head      = item->m_next;
+      --m_size;
+      return item;
+    }
+
+    void push(chunk *item) noexcept {
+      item->m_next = m_head;
+      m_head       = item;
+      ++m_size;
+    }
   };
-  std::atomic<block_ptr> m_allocator_head;
-  std::vector<chunk *> m_allocated_blocks{nullptr};
 
-  std::atomic_bool m_block_allocating{false};
+  // Shared by the allocator and every thread still holding its magazines.
+  struct depot {
+    std::mutex m_mutex;
+    std::vector<chunk *> m_blocks;
+    std::vector<magazine> m_full;
+    magazine m_partial;
 
-public:
-  pool_allocator() {
-    block_ptr ptr{nullptr, 0};
-    m_allocator_head.store(ptr);
-    allocate_block();
-  }
-  ~pool_allocator() {
-    for (auto &block : m_allocated_blocks) {
-      delete[] block;
+    ~depot() {
+      for (auto &block : m_blocks) {
+        delete[] block;
+      }
+    }
+
+    magazine take() {
+      std::unique_lock lk(m_mutex);
+      if (m_full.empty() && m_partial.m_size == 0) {
+        grow();
+      }
+      if (!m_full.empty()) {
+        magazine mag = m_full.back();
+        m_full.pop_back();
+        return mag;
+      }
+      // Partial chunks left behind by exited threads.
+      magazine mag;
+      while (m_partial.m_size > 0 && mag.m_size < magazine_size) {
+        mag.push(m_partial.pop());
+      }
+      return mag;
+    }
+
+    void give(magazine mag) {
+      if (mag.m_size == 0) {
+        return;
+      }
+      std::unique_lock lk(m_mutex);
+      if (mag.m_size == magazine_size) {
+        m_full.push_back(mag);
+        return;
+      }
+      while (mag.m_size > 0) {
+        m_partial.push(mag.pop());
+      }
+    }
+
+    void grow() {
+      chunk *block = new chunk[block_size];
+      m_blocks.push_back(block);
+      for (unsigned int i = 0; i < block_size; i += magazine_size) {
+        magazine mag;
+        for (unsigned int j = 0; j < magazine_size; ++j) {
+          mag.push(&block[i + j]);
+        }
+        m_full.push_back(mag);
+      }
+    }
+  };
+
+  // The magazines of one thread for one allocator.
+  struct rack {
+    std::shared_ptr<depot> m_depot;
+    magazine m_loaded;
+    magazine m_previous;
+
+    ~rack() {
+      m_depot->give(m_loaded);
+      m_depot->give(m_previous);
+    }
+
+    chunk *allocate() {
+      if (m_loaded.m_size == 0) [[unlikely]] {
+        if (m_previous.m_size > 0) {
+          std::swap(m_loaded, m_previous);
+        } else {
+          m_loaded = m_depot->take();
+        }
+      }
+      return m_loaded.pop();
     }
-  }
 
-  void allocate_block() {
-    if (m_block_allocating.exchange(true) == false) {
-      chunk *new_block = new chunk[block_size];
-      m_allocated_blocks.push_back(new_block);
-      for (unsigned int i = 0; i < block_size - 1; ++i) {
-        new_block[i].m_next = &new_block[i + 1];
+    void deallocate(chunk *item) {
+      if (m_loaded.m_size == magazine_size) [[unlikely]] {
+        if (m_previous.m_size == magazine_size) {
+          m_depot->give(std::exchange(m_previous, magazine{}));
+        }
+        std::swap(m_loaded, m_previous);
       }
-      block_ptr new_head{new_block, 0};
-      block_ptr curr_head = m_allocator_head.load();
-      do {
-        new_block[block_size - 1].m_next = curr_head.m_ptr;
-        new_head.m_tag                   = curr_head.m_tag + 1;
-      } while (!m_allocator_head.compare_exchange_strong(curr_head, new_head));
-
-      m_block_allocating.store(false);
+      m_loaded.push(item);
+    }
+  };
+
+  /* Racks of a thread, handed back to their depots once it exits. The fast
+   * paths read m_last_rack, which needs no guard as it has no destructor.
+   */
+  struct thread_racks {
+    std::vector<std::unique_ptr<rack>> m_racks;
+
+    ~thread_racks() {
+      m_racks.clear();
+      m_last_rack   = nullptr;
+      m_racks_freed = true;
     }
+
+    rack *find(const std::shared_ptr<depot> &owner) {
+      for (auto &r : m_racks) {
+        if (r->m_depot == owner) {
+          return r.get();
+        }
+      }
+      // Drop the racks of destroyed allocators before adding one.
+      std::erase_if(m_racks,
+                    [](auto &r) { return r->m_depot.use_count() == 1; });
+      auto &r    = m_racks.emplace_back(std::make_unique<rack>());
+      r->m_depot = owner;
+      return r.get();
+    }
+  };
+
+  inline static thread_local rack *m_last_rack  = nullptr;
+  inline static thread_local bool m_racks_freed = false;
+  inline static thread_local thread_racks m_racks;
+
+  std::shared_ptr<depot> m_depot = std::make_shared<depot>();
+
+  rack *local_rack() {
+    rack *r = m_last_rack;
+    if (r != nullptr && r->m_depot == m_depot) [[likely]] {
+      return r;
+    }
+    if (m_racks_freed) [[unlikely]] {
+      return nullptr;
+    }
+    m_last_rack = m_racks.find(m_depot);
+    return m_last_rack;
   }
 
+  chunk *allocate_chunk() {
+    rack *r = local_rack();
+    if (r == nullptr) [[unlikely]] {
+      // A thread local destructor running after ours, go to the depot.
+      magazine mag = m_depot->take();
+      chunk *item  = mag.pop();
+      m_depot->give(mag);
+      return item;
+    }
+    return r->allocate();
+  }
+
+public:
+  pool_allocator() = default;
+
+  pool_allocator(const pool_allocator &)            = delete;
+  pool_allocator &operator=(const pool_allocator &) = delete;
+
   template <typename O = T>
   O *allocate() {
-    block_ptr head = m_allocator_head.load();
-    block_ptr new_head{nullptr, 0};
-    do {
-      while (head.m_ptr == nullptr)
-        [[unlikely]] {
-          allocate_block();
-          head = m_allocator_head.load();
-        }
-      new_head.m_ptr = head.m_ptr->m_next;
-      new_head.m_tag = head.m_tag + 1;
-    } while (!m_allocator_head.compare_exchange_strong(head, new_head));
-
-    return new (head.m_ptr) O;
+    return new (allocate_chunk()) O;
   }
 
   template <typename O = T, typename... Args>
   O *allocate(Args &&...args) {
-    block_ptr head = m_allocator_head.load();
-    block_ptr new_head{nullptr, 0};
-    do {
-      while (head.m_ptr == nullptr)
-        [[unlikely]] {
-          allocate_block();
-          head = m_allocator_head.load();
-        }
-      new_head.m_ptr = head.m_ptr->m_next;
-      new_head.m_tag = head.m_tag + 1;
-    } while (!m_allocator_head.compare_exchange_strong(head, new_head));
-
-    return new (head.m_ptr) O(args...);
+    return new (allocate_chunk()) O(args...);
   }
 
   template <typename O = T>
   void deallocate(O *ptr) {
     ptr->~O();
-    block_ptr new_head{reinterpret_cast<chunk *>(ptr), 0};
-    block_ptr head = m_allocator_head.load();
-    do {
-      new_head.m_ptr->m_next = head.m_ptr;
-      new_head.m_tag         = head.m_tag + 1;
-    } while (!m_allocator_head.compare_exchange_strong(head, new_head));
+    auto *item = reinterpret_cast<chunk *>(ptr);
+    rack *r    = local_rack();
+    if (r == nullptr) [[unlikely]] {
+      magazine mag;
+      mag.push(item);
+      m_depot->give(mag);
+      return;
+    }
+    r->deallocate(item);
   }
 };
 
-#endif
\ No newline at end of file
+#endif
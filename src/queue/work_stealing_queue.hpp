@@ -1,26 +1,60 @@
 #ifndef __QUEUE_WORK_STEALING_QUEUE_HPP__
 #define __QUEUE_WORK_STEALING_QUEUE_HPP__
 
+#include "cache_line.hpp"
 #include "circular_array.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
+#include <vector>
 
 template <typename T>
 class work_stealing_queue {
 
-  std::atomic<size_t> m_front;
-  std::atomic<size_t> m_back;
+  /* Written by thieves. Kept off the line of m_back so that a steal does not
+   * take the line the owner pushes on and the other way round.
+   */
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_front;
+
+  // Thieves reading from an array, retired ones are freed while it is 0.
+  std::atomic_uint m_stealers{0};
+
+  // Written by the owner, m_data is read along with m_back by a thief.
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_back;
   std::atomic<circular_array<T> *> m_data{nullptr};
-  std::atomic<circular_array<T> *> m_old{nullptr};
+
+  // Owner only, arrays replaced by a resize that a thief may still read.
+  std::vector<circular_array<T> *> m_retired;
+
+  // Initial capacity, an idle queue shrinks back toward it.
+  size_t m_capacity;
+  bool m_shrink;
+  unsigned int m_idle = 0;
+
+  // Empty dequeues since the last resize before the array is halved.
+  static constexpr unsigned int SHRINK_AFTER = 64;
 
 public:
-  explicit work_stealing_queue(size_t capacity) {
+  explicit work_stealing_queue(size_t capacity, bool shrink = true)
+      : m_capacity{capacity}
+      , m_shrink{shrink} {
     m_front.store(0, std::memory_order_relaxed);
     m_back.store(0, std::memory_order_relaxed);
     m_data.store(new circular_array<T>(capacity), std::memory_order_relaxed);
   }
 
-  ~work_stealing_queue() { delete m_data.load(std::memory_order_relaxed); }
+  ~work_stealing_queue() {
+    delete m_data.load(std::memory_order_relaxed);
+    for (auto *data : m_retired) {
+      delete data;
+    }
+  }
+
+  // Capacity of the current array.
+  size_t capacity() const noexcept {
+    return m_data.load(std::memory_order_relaxed)->size();
+  }
 
   bool empty() const noexcept {
     size_t back  = m_back.load(std::memory_order_relaxed);
@@ -28,6 +62,13 @@ public:
     return back == front;
   }
 
+  // Number of queued items, only a hint while the owner or thieves are busy.
+  size_t size() const noexcept {
+    size_t back  = m_back.load(std::memory_order_relaxed);
+    size_t front = m_front.load(std::memory_order_relaxed);
+    return back > front ? back - front : 0;
+  }
+
   void enqueue(const T &item) {
     size_t back             = m_back.load(std::memory_order_relaxed);
     size_t front            = m_front.load(std::memory_order_acquire);
@@ -39,10 +80,10 @@ public:
           size_t a  = 0;
           auto size = (back + ((a - 1) - front)) + 1;
           if (data->size() - 1 < size) {
-            data = resize(data, back, front);
+            data = resize(data, back, front, 2 * data->size());
           }
         } else {
-          data = resize(data, back, front);
+          data = resize(data, back, front, 2 * data->size());
         }
       }
     }
@@ -52,27 +93,30 @@ public:
   }
 
   bool dequeue(T &item) {
-    size_t back             = m_back.load(std::memory_order_relaxed);
+    size_t back             = m_back.load(std::memory_order_relaxed) - 1;
     circular_array<T> *data = m_data.load(std::memory_order_relaxed);
-    size_t front            = m_front.load(std::memory_order_seq_cst);
 
-    if (front == back || front == back + 1) {
+    // Claim the back slot before looking at front, else two thieves may take
+    // the last two items in between and the owner pops a stolen one again.
+    m_back.store(back, std::memory_order_seq_cst);
+    size_t front = m_front.load(std::memory_order_seq_cst);
+
+    if (static_cast<std::ptrdiff_t>(back - front) < 0) {
+      m_back.store(back + 1, std::memory_order_relaxed);
+      if (data->size() > m_capacity || !m_retired.empty()) [[unlikely]] {
+        idle(data, back + 1);
+      }
       return false;
     }
-    m_back.store(--back, std::memory_order_seq_cst);
-
-    bool status = true;
 
     item = data->pop(back);
-    if (front == back) {
-      m_back.store(back + 1, std::memory_order_seq_cst);
-      if (!m_front.compare_exchange_strong(front, front + 1,
-                                           std::memory_order_seq_cst,
-                                           std::memory_order_relaxed)) {
-        status = false;
-      }
+    if (front != back) {
+      return true;
     }
 
+    bool status = m_front.compare_exchange_strong(
+        front, front + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    m_back.store(back + 1, std::memory_order_relaxed);
     return status;
   }
 
@@ -85,21 +129,90 @@ public:
       return false;
     }
 
-    circular_array<T> *data = m_data.load(std::memory_order_consume);
+    // Pin the array before loading it, see reclaim().
+    m_stealers.fetch_add(1, std::memory_order_seq_cst);
+    circular_array<T> *data = m_data.load(std::memory_order_seq_cst);
     item                    = data->pop(front);
+    m_stealers.fetch_sub(1, std::memory_order_release);
     return m_front.compare_exchange_strong(
         front, front + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
   }
 
+  /* Move up to max items, and no more than half of the queue rounded up,
+   * from the front into out, the deque of the thief. Returns the number
+   * moved.
+   *
+   * The items are claimed back to back while the thief holds the line of
+   * m_front, but each with a CAS of its own: the owner pops without one
+   * until it reaches front, so a single CAS over a range claimed on a stale
+   * m_back could take items the owner already popped.
+   */
+  size_t steal_batch(work_stealing_queue &out, size_t max) {
+    size_t front = m_front.load();
+    size_t back  = m_back.load();
+
+    if (static_cast<std::ptrdiff_t>(back - front) <= 0) {
+      return 0;
+    }
+    size_t count = std::min(max, (back - front + 1) / 2);
+
+    // Pinned once for the whole batch, see reclaim().
+    m_stealers.fetch_add(1, std::memory_order_seq_cst);
+    size_t moved = 0;
+    while (moved < count && static_cast<std::ptrdiff_t>(back - front) > 0) {
+      // Reloaded after back, an item pushed since may only be in a new array.
+      circular_array<T> *data = m_data.load(std::memory_order_seq_cst);
+      T item                  = data->pop(front);
+      if (!m_front.compare_exchange_strong(front, front + 1,
+                                           std::memory_order_seq_cst,
+                                           std::memory_order_relaxed)) {
+        // Another thief or the owner got there, leave the rest to them.
+        break;
+      }
+      out.enqueue(item);
+      ++moved;
+      ++front;
+      back = m_back.load();
+    }
+    m_stealers.fetch_sub(1, std::memory_order_release);
+    return moved;
+  }
+
 protected:
-  circular_array<T> *resize(circular_array<T> *data, size_t back,
-                            size_t front) {
-    circular_array<T> *new_data = data->resize(back, front);
-    delete m_old.load(std::memory_order_relaxed);
-    m_old.store(data, std::memory_order_relaxed);
-    m_data.store(new_data, std::memory_order_relaxed);
+  circular_array<T> *resize(circular_array<T> *data, size_t back, size_t front,
+                            size_t capacity) {
+    circular_array<T> *new_data = data->resize(back, front, capacity);
+    m_data.store(new_data, std::memory_order_seq_cst);
+    m_retired.push_back(data);
+    m_idle = 0;
+    reclaim();
     return new_data;
   }
+
+  /* A thief counts itself in before it loads m_data. Once the owner has
+   * swapped m_data and sees no thief, any thief still to come loads the new
+   * array, so every retired one can go.
+   */
+  void reclaim() {
+    if (m_retired.empty() ||
+        m_stealers.load(std::memory_order_seq_cst) != 0) {
+      return;
+    }
+    for (auto *data : m_retired) {
+      delete data;
+    }
+    m_retired.clear();
+  }
+
+  // The owner found the queue empty, halve an array grown by a burst.
+  void idle(circular_array<T> *data, size_t back) {
+    reclaim();
+    if (!m_shrink || data->size() <= m_capacity || ++m_idle < SHRINK_AFTER) {
+      return;
+    }
+    size_t front = m_front.load(std::memory_order_acquire);
+    resize(data, back, front, data->size() / 2);
+  }
 };
 
 #endif
\ No newline at end of file
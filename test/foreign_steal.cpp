@@ -0,0 +1,81 @@
+#include "coroutine/launch.hpp"
+#include "coroutine/scheduler/scheduler.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <thread>
+
+/* A thread outside the scheduler asking for the next coroutine steals from
+ * the workers. It has no deque of its own, so it must take single tasks
+ * rather than a batch. The worker holding the tasks is kept busy until the
+ * main thread has run all of them.
+ */
+
+constexpr int JOBS = 256;
+
+std::atomic_int ran{0};
+std::atomic_int on_main{0};
+std::atomic_bool queued{false};
+std::thread::id main_id;
+
+struct job {
+  struct promise_type {
+    job get_return_object() {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  std::coroutine_handle<> m_handle;
+};
+
+job count() {
+  if (std::this_thread::get_id() == main_id) {
+    ++on_main;
+  }
+  ++ran;
+  co_return;
+}
+
+launch<int> producer(scheduler *s) {
+  for (int i = 0; i < JOBS; ++i) {
+    s->schedule(count().m_handle);
+  }
+  queued = true;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (ran.load() < JOBS && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  co_return 0;
+}
+
+int main() {
+  main_id = std::this_thread::get_id();
+  scheduler s(1, 1);
+  launch<int> l = producer(&s).schedule_on(&s);
+  while (!queued.load()) {
+    std::this_thread::yield();
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (ran.load() < JOBS && std::chrono::steady_clock::now() < deadline) {
+    std::coroutine_handle<> handle = s.get_next_coroutine();
+    if (handle) {
+      handle.resume();
+    }
+  }
+  int result = l;
+
+  if (on_main.load() != JOBS) {
+    std::cerr << "main ran " << on_main.load() << " of " << JOBS
+              << " tasks queued on the worker\n";
+    return 1;
+  }
+  return result;
+}
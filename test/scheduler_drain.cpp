@@ -0,0 +1,59 @@
+#include "coroutine/Awaiters.hpp"
+#include "coroutine/launch.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+/* The destructor runs what is queued to the end, and gives up on tasks that
+ * never let the workers go idle once the drain timeout has passed.
+ */
+
+std::atomic_int done{0};
+
+launch<int> finite(int n) {
+  for (int i = 0; i < n; ++i) {
+    co_await yield();
+  }
+  ++done;
+  co_return n;
+}
+
+launch<int> endless() {
+  while (true) {
+    co_await yield();
+  }
+  co_return 0;
+}
+
+int main() {
+  bool ok = true;
+  {
+    scheduler s(2);
+    for (int i = 0; i < 100; ++i) {
+      finite(50).schedule_on(&s);
+    }
+  }
+  if (done.load() != 100) {
+    std::cerr << "drained " << done.load() << " of 100 tasks\n";
+    ok = false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    scheduler s(2);
+    s.set_drain_timeout(std::chrono::milliseconds(50));
+    for (int i = 0; i < 10; ++i) {
+      endless().schedule_on(&s);
+    }
+  }
+  auto took = std::chrono::steady_clock::now() - start;
+  if (took > std::chrono::seconds(5)) {
+    std::cerr << "destructor took "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(took)
+                     .count()
+              << " ms past a 50 ms drain timeout\n";
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+#include "coroutine/launch.hpp"
+#include "coroutine/scheduler/scheduler.hpp"
+#include "io/io_service.hpp"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+/* Dropping a stream whose op is still prepared in the SQ of the worker that
+ * started it, not yet handed to the kernel, must cancel the op once it gets
+ * there. Otherwise the multishot accept stays armed and takes the next
+ * connection for nobody.
+ */
+
+std::atomic_bool started{false};
+std::atomic_bool dropping{false};
+io_stream<io_service> *held = nullptr;
+
+launch<int> start(io_service &io, int listener) {
+  held = new io_stream<io_service>(io.accept_multishot(listener, 0));
+  started = true;
+  // Stay busy so the worker does not poll, the sqe is not submitted yet.
+  while (!dropping.load()) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  co_return 0;
+}
+
+int main() {
+  scheduler schd(1, 1);
+  io_service io(64, 0, schd, IO_RING_MODE::PER_THREAD);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length     = sizeof(addr);
+  if (bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 16) < 0 ||
+      getsockname(listener, (sockaddr *)&addr, &length) < 0) {
+    std::cerr << "Listener setup failed\n";
+    return 1;
+  }
+
+  launch<int> l = start(io, listener).schedule_on(&schd);
+  while (!started.load()) {
+    std::this_thread::yield();
+  }
+  dropping = true;
+  delete held;
+  int result = l;
+
+  // Give an op still armed the time to take the connection first.
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  connect(client, (sockaddr *)&addr, sizeof(addr));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  int accepted = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+  close(client);
+  close(listener);
+  if (accepted < 0) {
+    std::cerr << "The dropped multishot accept is still armed\n";
+    return 1;
+  }
+  close(accepted);
+  return result;
+}
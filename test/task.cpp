@@ -0,0 +1,65 @@
+#include "coroutine/launch.hpp"
+#include "coroutine/task.hpp"
+
+#include <atomic>
+#include <iostream>
+
+/* A task owns its frame: dropping the task, awaited or not, and assigning
+ * another task over it destroy the frame. Frames are counted through an
+ * argument, which is copied into the frame.
+ */
+
+std::atomic_int live{0};
+
+struct probe {
+  probe() { ++live; }
+  probe(const probe &) { ++live; }
+  probe(probe &&) { ++live; }
+  ~probe() { --live; }
+};
+
+task<int> value(probe, int v) { co_return v; }
+
+launch<int> awaited() {
+  int sum = 0;
+  for (int i = 0; i < 100; ++i) {
+    auto t = value(probe{}, i);
+    sum += co_await t;
+  }
+  co_return sum;
+}
+
+bool check(const char *what, int frames) {
+  if (live.load() != frames) {
+    std::cerr << what << ": " << live.load() << " frames alive, expected "
+              << frames << "\n";
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  bool ok = true;
+  {
+    auto t = value(probe{}, 1);
+    ok &= check("held", 1);
+  }
+  ok &= check("dropped", 0);
+
+  {
+    auto t = value(probe{}, 1);
+    t      = value(probe{}, 2);
+    ok &= check("assigned", 1);
+    auto &same = t;
+    t          = std::move(same);
+    ok &= check("self assigned", 1);
+  }
+  ok &= check("assigned and dropped", 0);
+
+  {
+    scheduler s(2);
+    ok &= awaited().schedule_on(&s) == 4950;
+  }
+  ok &= check("awaited", 0);
+  return ok ? 0 : 1;
+}
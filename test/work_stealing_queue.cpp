@@ -0,0 +1,65 @@
+#include "queue/work_stealing_queue.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/* The owner pushes two items at a time and pops them back while thieves
+ * steal from the front, so most rounds end with the owner and the thieves
+ * racing for the last items. Every item has to be taken exactly once.
+ */
+
+constexpr size_t ITEMS         = 1 << 20;
+constexpr size_t ROUND         = 2;
+constexpr unsigned int THIEVES = 3;
+
+int main() {
+  work_stealing_queue<size_t> queue(1024);
+  std::vector<std::atomic_uint8_t> taken(ITEMS);
+  std::atomic_bool done{false};
+
+  auto take = [&](size_t item) {
+    taken[item].fetch_add(1, std::memory_order_relaxed);
+  };
+
+  std::vector<std::thread> thieves;
+  for (unsigned int i = 0; i < THIEVES; ++i) {
+    thieves.emplace_back([&] {
+      size_t item;
+      while (!done.load(std::memory_order_acquire)) {
+        if (queue.steal(item)) {
+          take(item);
+        }
+      }
+    });
+  }
+
+  size_t item;
+  for (size_t next = 0; next < ITEMS;) {
+    for (size_t i = 0; i < ROUND && next < ITEMS; ++i) {
+      queue.enqueue(next++);
+    }
+    while (queue.dequeue(item)) {
+      take(item);
+    }
+  }
+  done.store(true, std::memory_order_release);
+  for (auto &thief : thieves) {
+    thief.join();
+  }
+
+  size_t lost  = 0;
+  size_t twice = 0;
+  for (auto &count : taken) {
+    auto n = count.load(std::memory_order_relaxed);
+    lost += n == 0;
+    twice += n > 1;
+  }
+  if (lost != 0 || twice != 0) {
+    std::cerr << lost << " items lost, " << twice << " taken twice\n";
+    return 1;
+  }
+  return 0;
+}